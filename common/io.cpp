@@ -1,7 +1,17 @@
 #include "io.hpp"
 
+#include <atomic>
+#include <climits>
+#include <condition_variable>
 #include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
+#include <mutex>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #include "tools/logging/logging.hpp"
 
@@ -48,107 +58,517 @@ vector<Folder> listFiles(std::string path, std::string ext) {
 	return result;
 }
 
-void Dataset::loadDataset(std::string path, std::vector<Mat> &dataset) {
-	std::string dirToOpen = path;
-	DIR * dir = opendir(dirToOpen.c_str());
-	struct dirent * entity = readdir(dir);
+// List image files (sorted) of the directory
+vector<string> Dataset::listImages(std::string path) {
+	static const char *extensions[] = { ".jpg", ".jpeg", ".png", ".bmp", ".pgm", ".ppm", ".tif", ".tiff" };
+	vector<string> fileNames;
+	DIR * dir = opendir(path.c_str());
 
-	while (entity != NULL) {
-		if (entity->d_type == DT_DIR) {
-			// Directory
-			// Just skip it
-		} else if (entity->d_type == DT_REG) {
-			// Regular file
-			std::string fileName = std::string(entity->d_name);
-			Mat img = imread(path + "/" + fileName);
-			cv::cvtColor(img, img, CV_BGR2GRAY);
-			dataset.push_back(img);
+	if (dir == NULL) {
+		Logger::error("Unable to open directory " + path);
+		return fileNames;
+	}
+	for (struct dirent * entity = readdir(dir); entity != NULL; entity = readdir(dir)) {
+		if (entity->d_type != DT_REG) {
+			continue;
+		}
+		std::string fileName = std::string(entity->d_name);
+		std::string ext = fileName.substr(std::min(fileName.rfind('.'), fileName.size()));
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		for (const char *e : extensions) {
+			if (ext == e) {
+				fileNames.push_back(path + "/" + fileName);
+				break;
+			}
 		}
-		entity = readdir(dir);
 	}
 	closedir(dir);
+	std::sort(fileNames.begin(), fileNames.end());
+	return fileNames;
 }
 
-void Dataset::prepareTrainingSet(std::vector<Mat> &dataset, std::vector<Mat> &trainingSet, long batchSize, int patchSize) {
-	int i, j, k, n;
-	Mat img, patch;
+void Dataset::loadDataset(std::string path, std::vector<Mat> &dataset, int numOfThreads, double scale) {
+	streamDataset(path, [&dataset](Mat &img) {
+		dataset.push_back(img);
+	}, numOfThreads, scale);
+}
+
+void Dataset::streamDataset(std::string path, std::function<void(Mat&)> consumer, int numOfThreads, double scale) {
+	const vector<string> fileNames = listImages(path);
 
-	srand(time(NULL));
-	for ( n = 0; n < batchSize; n++ ) {
-		do {
-			k = random() % dataset.size();
-			img = dataset.at(k);
-			i = random() % (img.rows - patchSize);
-			j = random() % (img.cols - patchSize);
-			patch = img(cv::Rect(j, i, patchSize, patchSize)).clone();
-		} while ( !cv::sum(patch)[0] );
-		trainingSet.push_back(patch);
+	if (numOfThreads <= 0) {
+		numOfThreads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	// Decoded images waiting for their turn, the decoders never run more than
+	// window images ahead of the consumer to keep the memory bounded
+	const size_t window = 4 * numOfThreads;
+	vector<Mat> images(fileNames.size());
+	vector<char> decoded(fileNames.size(), 0);
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::atomic<size_t> claimed(0);
+	size_t consumed = 0;
+
+	auto decode = [&]() {
+		for (size_t n = claimed++; n < fileNames.size(); n = claimed++) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [&]() { return n < consumed + window; });
+			}
+			Mat img = imread(fileNames[n]);
+			if (!img.empty()) {
+				cv::cvtColor(img, img, CV_BGR2GRAY);
+				if (scale != 1.0) {
+					cv::resize(img, img, Size(), scale, scale, INTER_AREA);
+				}
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			images[n] = img;
+			decoded[n] = 1;
+			condition.notify_all();
+		}
+	};
+
+	vector<std::thread> threads;
+	for (int t = 0; t < numOfThreads; t++) {
+		threads.push_back(std::thread(decode));
+	}
+
+	// Hand the images over in order
+	for (size_t n = 0; n < fileNames.size(); n++) {
+		Mat img;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&]() { return decoded[n] != 0; });
+			img = images[n];
+			images[n].release();
+			consumed++;
+			condition.notify_all();
+		}
+		if (img.empty()) {
+			Logger::warning("Unable to read image " + fileNames[n]);
+		} else {
+			consumer(img);
+		}
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
 	}
 }
 
-int Dataset::reverseInt(int i) {
-	unsigned char ch1, ch2, ch3, ch4;
+void Dataset::prepareTrainingSet(std::vector<Mat> &dataset, std::vector<Mat> &trainingSet, long batchSize, int patchSize,
+                                 uint64_t seed) {
+	PatchSampler sampler(dataset, patchSize, seed);
+	vector<Mat> batch;
 
-	ch1 = i & 255;
-	ch2 = (i >> 8) & 255;
-	ch3 = (i >> 16) & 255;
-	ch4 = (i >> 24) & 255;
-	return ((int) ch1 << 24) + ((int) ch2 << 16) + ((int) ch3 << 8) + ch4;
+	sampler.nextBatch(batch, batchSize);
+	trainingSet.reserve(trainingSet.size() + batch.size());
+	for (auto &patch : batch) {
+		trainingSet.push_back(patch.clone());
+	}
 }
 
-void Dataset::loadMNIST(string filename, vector<cv::Mat> &vec) {
-	ifstream file(filename.c_str(), ios::binary);
-
-	if (file.is_open()) {
-		int magic_number = 0;
-		int number_of_images = 0;
-		int n_rows = 0;
-		int n_cols = 0;
-
-		file.read((char*) &magic_number, sizeof(magic_number));
-		magic_number = reverseInt(magic_number);
-		file.read((char*) &number_of_images, sizeof(number_of_images));
-		number_of_images = reverseInt(number_of_images);
-		file.read((char*) &n_rows, sizeof(n_rows));
-		n_rows = reverseInt(n_rows);
-		file.read((char*) &n_cols, sizeof(n_cols));
-		n_cols = reverseInt(n_cols);
-
-		for (int i = 0; i < number_of_images; i++) {
-			cv::Mat tp = cv::Mat::zeros(n_rows, n_cols, CV_8UC1);
-			for (int r = 0; r < n_rows; r++) {
-				for (int c = 0; c < n_cols; c++) {
-					unsigned char temp = 0;
-					file.read((char*) &temp, sizeof(temp));
-					tp.at<uchar>(r, c) = (int) temp;
-				}
+PatchSampler::PatchSampler(const vector<Mat> &dataset, int patchSize, uint64_t seed) : dataset(dataset) {
+	this->patchSize = patchSize;
+	this->seed = seed;
+	this->counter = 0;
+	this->occupancy.resize(dataset.size());
+
+	for (size_t k = 0; k < dataset.size(); k++) {
+		const Mat &image = dataset[k];
+		if (image.rows < patchSize || image.cols < patchSize) {
+			continue;
+		}
+		Mat occupied = Mat::zeros((image.rows + BLOCK_SIZE - 1) / BLOCK_SIZE, (image.cols + BLOCK_SIZE - 1) / BLOCK_SIZE, CV_8UC1);
+		for (int i = 0; i < image.rows; i++) {
+			const uchar *row = image.ptr<uchar>(i);
+			uchar *blocks = occupied.ptr<uchar>(i / BLOCK_SIZE);
+			for (int j = 0; j < image.cols; j++) {
+				blocks[j / BLOCK_SIZE] |= (row[j] != 0);
 			}
-			vec.push_back(tp);
+		}
+		cv::integral(occupied, this->occupancy[k], CV_32S);
+		this->images.push_back(k);
+	}
+}
+
+// SplitMix64 finalizer applied to the (seed, patch, attempt) counter
+uint64_t PatchSampler::random(uint64_t seed, uint64_t n, uint64_t attempt) {
+	uint64_t z = seed + 0x9E3779B97F4A7C15ULL * (n * 1024 + attempt + 1);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// Number of occupied blocks in the given range of blocks
+int PatchSampler::countBlocks(const Mat &sum, int top, int left, int bottom, int right) {
+	if (bottom <= top || right <= left) {
+		return 0;
+	}
+	return sum.at<int>(bottom, right) - sum.at<int>(top, right) - sum.at<int>(bottom, left) + sum.at<int>(top, left);
+}
+
+// A patch containing an occupied block is not blank, a patch touching only
+// empty blocks is, and only the patches in between are read pixel by pixel
+bool PatchSampler::isBlank(size_t k, int i, int j) const {
+	const Mat &sum = this->occupancy[k];
+	const int p = this->patchSize;
+
+	if (countBlocks(sum, (i + BLOCK_SIZE - 1) / BLOCK_SIZE, (j + BLOCK_SIZE - 1) / BLOCK_SIZE,
+	                (i + p) / BLOCK_SIZE, (j + p) / BLOCK_SIZE) > 0) {
+		return false;
+	}
+	if (countBlocks(sum, i / BLOCK_SIZE, j / BLOCK_SIZE,
+	                (i + p + BLOCK_SIZE - 1) / BLOCK_SIZE, (j + p + BLOCK_SIZE - 1) / BLOCK_SIZE) == 0) {
+		return true;
+	}
+	return cv::countNonZero(this->dataset[k](cv::Rect(j, i, p, p))) == 0;
+}
+
+Mat PatchSampler::getPatch(uint64_t n) const {
+	// Blank patches are rejected, but a dataset with (almost) nothing
+	// but blank images must not hang the sampler
+	const uint64_t maxAttempts = 1000;
+	size_t k = 0;
+	int i = 0, j = 0;
+
+	if (this->images.empty()) {
+		return Mat();
+	}
+	for (uint64_t attempt = 0; attempt < maxAttempts; attempt++) {
+		uint64_t r = random(this->seed, n, attempt);
+		k = this->images[r % this->images.size()];
+		r /= this->images.size();
+		i = r % (this->dataset[k].rows - this->patchSize + 1);
+		r /= (this->dataset[k].rows - this->patchSize + 1);
+		j = r % (this->dataset[k].cols - this->patchSize + 1);
+		if (!isBlank(k, i, j)) {
+			break;
+		}
+	}
+	return this->dataset[k](cv::Rect(j, i, this->patchSize, this->patchSize));
+}
+
+void PatchSampler::nextBatch(vector<Mat> &batch, size_t batchSize) {
+	batch.resize(batchSize);
+	for (size_t n = 0; n < batchSize; n++) {
+		batch[n] = getPatch(this->counter + n);
+	}
+	this->counter += batchSize;
+}
+
+void PatchSampler::nextBatch(Mat &batch, size_t batchSize, int numOfThreads) {
+	const uint64_t first = this->counter;
+	const int p = this->patchSize;
+
+	batch.create(batchSize, p * p, CV_8UC1);
+	auto fill = [&](size_t from, size_t to) {
+		for (size_t n = from; n < to; n++) {
+			Mat patch = getPatch(first + n);
+			uchar *row = batch.ptr<uchar>(n);
+			if (patch.empty()) {
+				memset(row, 0, p * p);
+			}
+			for (int i = 0; i < p && !patch.empty(); i++) {
+				memcpy(row + i * p, patch.ptr<uchar>(i), p);
+			}
+		}
+	};
+
+	numOfThreads = std::max(1, numOfThreads);
+	vector<std::thread> threads;
+	const size_t chunk = (batchSize + numOfThreads - 1) / numOfThreads;
+	for (int t = 1; t < numOfThreads; t++) {
+		threads.push_back(std::thread(fill, std::min(batchSize, t * chunk), std::min(batchSize, (t + 1) * chunk)));
+	}
+	fill(0, std::min(batchSize, chunk));
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	this->counter += batchSize;
+}
+
+// Map the whole file read-only, returns nullptr on failure
+static void* mapFile(std::string fileName, size_t &size) {
+	void *mapping = nullptr;
+	int fd = open(fileName.c_str(), O_RDONLY);
+
+	size = 0;
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr != MAP_FAILED) {
+			mapping = ptr;
+			size = st.st_size;
+		}
+	}
+	close(fd);
+	return mapping;
+}
+
+IdxFile::IdxFile(std::string fileName) {
+	this->data = nullptr;
+	this->mapping = mapFile(fileName, this->size);
+	if (this->mapping == nullptr || this->size <= 4) {
+		Logger::error("Unable to map IDX file " + fileName);
+		return;
+	}
+
+	// Magic number is 0x00, 0x00, data type (0x08 for unsigned byte), number of dimensions
+	const uchar *header = static_cast<const uchar*>(this->mapping);
+	const size_t ndims = header[3];
+	if (header[0] != 0 || header[1] != 0 || header[2] != 0x08 || ndims == 0 || this->size < 4 + 4 * ndims) {
+		Logger::error("Unsupported IDX file " + fileName);
+		return;
+	}
+
+	// Dimensions are stored as big endian 32 bit unsigned integers, the product
+	// is checked against the file size before every step, so it cannot overflow
+	const size_t available = this->size - (4 + 4 * ndims);
+	size_t total = 1;
+	for (size_t n = 0; n < ndims; n++) {
+		const uchar *d = header + 4 + 4 * n;
+		const uint32_t dim = (static_cast<uint32_t>(d[0]) << 24) | (static_cast<uint32_t>(d[1]) << 16) |
+		                     (static_cast<uint32_t>(d[2]) << 8) | d[3];
+		if (dim > static_cast<uint32_t>(INT_MAX)) {
+			Logger::error("Unsupported IDX file " + fileName);
+			this->dims.clear();
+			return;
+		}
+		if (dim > 0 && total > available / dim) {
+			Logger::error("Truncated IDX file " + fileName);
+			this->dims.clear();
+			return;
+		}
+		this->dims.push_back(static_cast<int>(dim));
+		total *= dim;
+	}
+	if (available < total) {
+		Logger::error("Truncated IDX file " + fileName);
+		this->dims.clear();
+		return;
+	}
+	this->data = header + 4 + 4 * ndims;
+}
+
+IdxFile::~IdxFile() {
+	if (this->mapping != nullptr) {
+		munmap(this->mapping, this->size);
+	}
+}
+
+Mat IdxFile::getItem(size_t n) const {
+	const int rows = (this->dims.size() > 1) ? this->dims[1] : 1;
+	const int cols = (this->dims.size() > 2) ? this->dims[2] : 1;
+	uchar *item = const_cast<uchar*>(this->data) + n * rows * cols;
+	return Mat(rows, cols, CV_8UC1, item);
+}
+
+Mat IdxFile::getTensor() const {
+	return Mat(static_cast<int>(this->dims.size()), this->dims.data(), CV_8UC1, const_cast<uchar*>(this->data));
+}
+
+void Dataset::loadMNIST(string filename, vector<cv::Mat> &vec) {
+	IdxFile file(filename);
+
+	if (file.isOpen() && file.getDims().size() == 3) {
+		const int numberOfImages = file.getDims()[0];
+		const int nRows = file.getDims()[1];
+		const int nCols = file.getDims()[2];
+
+		// Copy all the images into one buffer at once, the returned
+		// images are headers sharing it (so they outlive the mapping)
+		Mat images(numberOfImages * nRows, nCols, CV_8UC1);
+		memcpy(images.data, file.getData(), static_cast<size_t>(numberOfImages) * nRows * nCols);
+		vec.reserve(vec.size() + numberOfImages);
+		for (int i = 0; i < numberOfImages; i++) {
+			vec.push_back(images.rowRange(i * nRows, (i + 1) * nRows));
+		}
+	}
+}
+
+// Zero-copy variant, the images point into the mapped file
+void Dataset::loadMNIST(const IdxFile &file, vector<cv::Mat> &vec) {
+	if (file.isOpen() && file.getDims().size() == 3) {
+		vec.reserve(vec.size() + file.getCount());
+		for (size_t i = 0; i < file.getCount(); i++) {
+			vec.push_back(file.getItem(i));
 		}
 	}
 }
 
 void Dataset::loadMNISTLabels(string filename, vector<double> &vec) {
-	ifstream file(filename.c_str(), ios::binary);
+	IdxFile file(filename);
+
+	if (file.isOpen() && file.getDims().size() == 1) {
+		const uchar *labels = file.getData();
+		vec.assign(labels, labels + file.getCount());
+	}
+}
 
-	if (file.is_open()) {
-		int magic_number = 0;
-		int number_of_images = 0;
-		int n_rows = 0;
-		int n_cols = 0;
+// Cache file layout: header, one entry per item, then the items' data
+// (each starting at a multiple of 8 bytes, rows stored without gaps)
+struct DatasetCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint64_t count;
+};
 
-		file.read((char*) &magic_number, sizeof(magic_number));
-		magic_number = reverseInt(magic_number);
-		file.read((char*) &number_of_images, sizeof(number_of_images));
-		number_of_images = reverseInt(number_of_images);
-		vec.resize(number_of_images);
+struct DatasetCacheEntry {
+	int32_t rows;
+	int32_t cols;
+	int32_t type;
+	int32_t reserved;
+	uint64_t offset;
+};
+
+static const char DATASET_CACHE_MAGIC[4] = { 'H', 'T', 'M', 'T' };
+static const uint32_t DATASET_CACHE_VERSION = 1;
+
+DatasetCache::DatasetCache() {
+	this->mapping = nullptr;
+	this->size = 0;
+}
+
+DatasetCache::~DatasetCache() {
+	this->unmap();
+}
+
+void DatasetCache::unmap() {
+	this->items.clear();
+	if (this->mapping != nullptr) {
+		munmap(this->mapping, this->size);
+		this->mapping = nullptr;
+		this->size = 0;
+	}
+}
+
+bool DatasetCache::map(std::string fileName, uint64_t key) {
+	this->unmap();
+	this->mapping = mapFile(fileName, this->size);
+	if (this->mapping == nullptr) {
+		return false;
+	}
+
+	const char *base = static_cast<const char*>(this->mapping);
+	const DatasetCacheHeader *header = reinterpret_cast<const DatasetCacheHeader*>(base);
+	if (this->size < sizeof(DatasetCacheHeader) || memcmp(header->magic, DATASET_CACHE_MAGIC, 4) != 0 ||
+		header->version != DATASET_CACHE_VERSION || header->key != key ||
+		header->count > (this->size - sizeof(DatasetCacheHeader)) / sizeof(DatasetCacheEntry)) {
+		this->unmap();
+		return false;
+	}
+
+	const DatasetCacheEntry *entries = reinterpret_cast<const DatasetCacheEntry*>(base + sizeof(DatasetCacheHeader));
+	this->items.reserve(header->count);
+	for (size_t n = 0; n < header->count; n++) {
+		const DatasetCacheEntry &e = entries[n];
+		// Sizes are checked one by one, so that no product could overflow
+		if (e.rows < 0 || e.cols < 0 || e.offset > this->size ||
+			static_cast<size_t>(e.rows) * e.cols > this->size ||
+			static_cast<size_t>(e.rows) * e.cols * CV_ELEM_SIZE(e.type) > this->size - e.offset) {
+			this->unmap();
+			return false;
+		}
+		this->items.push_back(Mat(e.rows, e.cols, e.type, const_cast<char*>(base + e.offset)));
+	}
+	return true;
+}
+
+bool DatasetCache::open(std::string fileName, uint64_t key, std::function<void(vector<Mat>&)> producer) {
+	if (this->map(fileName, key)) {
+		return true;
+	}
+	vector<Mat> items;
+	producer(items);
+	return write(fileName, key, items) && this->map(fileName, key);
+}
+
+bool DatasetCache::loadDataset(std::string fileName, std::string path, int numOfThreads, double scale) {
+	stringstream parameters;
+	parameters << "gray scale=" << scale;
+	return this->open(fileName, calculateKey(path, parameters.str()), [&](vector<Mat> &items) {
+		Dataset::loadDataset(path, items, numOfThreads, scale);
+	});
+}
+
+bool DatasetCache::write(std::string fileName, uint64_t key, const vector<Mat> &items) {
+	DatasetCacheHeader header;
+	vector<DatasetCacheEntry> entries(items.size());
+	uint64_t offset = sizeof(DatasetCacheHeader) + items.size() * sizeof(DatasetCacheEntry);
+
+	memcpy(header.magic, DATASET_CACHE_MAGIC, 4);
+	header.version = DATASET_CACHE_VERSION;
+	header.key = key;
+	header.count = items.size();
+	for (size_t n = 0; n < items.size(); n++) {
+		offset = (offset + 7) & ~static_cast<uint64_t>(7);
+		entries[n].rows = items[n].rows;
+		entries[n].cols = items[n].cols;
+		entries[n].type = items[n].type();
+		entries[n].reserved = 0;
+		entries[n].offset = offset;
+		offset += items[n].total() * items[n].elemSize();
+	}
+
+	// Written under a temporary name unique to the process and the thread,
+	// so a partial cache is never mapped, even when several runs build it at once
+	stringstream tmpName;
+	tmpName << fileName << ".tmp." << getpid() << "." << this_thread::get_id();
+	const std::string tmpFileName = tmpName.str();
+	ofstream file(tmpFileName.c_str(), ios::binary);
+	if (!file.is_open()) {
+		Logger::error("Unable to write dataset cache " + fileName);
+		return false;
+	}
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(DatasetCacheEntry));
+	for (size_t n = 0; n < items.size(); n++) {
+		const char padding[8] = { 0 };
+		file.write(padding, entries[n].offset - file.tellp());
+		if (items[n].isContinuous()) {
+			file.write(reinterpret_cast<const char*>(items[n].data), items[n].total() * items[n].elemSize());
+		} else {
+			for (int i = 0; i < items[n].rows; i++) {
+				file.write(reinterpret_cast<const char*>(items[n].ptr(i)), items[n].cols * items[n].elemSize());
+			}
+		}
+	}
+	file.close();
+	if (file.fail()) {
+		std::remove(tmpFileName.c_str());
+		return false;
+	}
+	return std::rename(tmpFileName.c_str(), fileName.c_str()) == 0;
+}
+
+uint64_t DatasetCache::calculateKey(std::string path, std::string parameters) {
+	uint64_t hash = 14695981039346656037ULL;
+	auto mix = [&hash](const void *data, size_t size) {
+		const uchar *bytes = static_cast<const uchar*>(data);
+		for (size_t n = 0; n < size; n++) {
+			hash = (hash ^ bytes[n]) * 1099511628211ULL;
+		}
+	};
 
-		for (int i = 0; i < number_of_images; i++) {
-			unsigned char temp = 0;
-			file.read((char*) &temp, sizeof(temp));
-			vec[i] = (double) temp;
+	for (const auto &fileName : Dataset::listImages(path)) {
+		struct stat st;
+		int64_t attributes[2] = { 0, 0 };
+		if (stat(fileName.c_str(), &st) == 0) {
+			attributes[0] = st.st_size;
+			attributes[1] = st.st_mtime;
 		}
+		mix(fileName.c_str(), fileName.size() + 1);
+		mix(attributes, sizeof(attributes));
 	}
+	mix(parameters.c_str(), parameters.size());
+	return hash;
 }
 
 long long BinaryFileHelper::readLL(std::fstream &f, int pos) {
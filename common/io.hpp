@@ -1,7 +1,10 @@
 #ifndef IO_HPP_
 #define IO_HPP_
 
+#include <cstdint>
+#include <ctime>
 #include <dirent.h>
+#include <functional>
 #include <opencv2/opencv.hpp>
 #include <vector>
 
@@ -21,16 +24,137 @@ class Folder {
 // List all files given the path and the required file extension
 vector<Folder> listFiles(std::string path, std::string ext = string(".jpg"));
 
-// Dataset class is used to load and prepare data for the further usage
-class Dataset {
+// Memory mapped IDX file (the MNIST format) of unsigned bytes. The returned
+// matrices point directly into the mapping, which is read-only and shared by
+// all the processes through the page cache, so they are valid only as long
+// as the IdxFile exists.
+class IdxFile {
+	private:
+		void *mapping;
+		size_t size;
+		vector<int> dims;
+		const uchar *data;
+
+	public:
+		IdxFile( ) = delete;
+		IdxFile( const IdxFile& ) = delete;
+		IdxFile& operator=( const IdxFile& ) = delete;
+		// Map the file and validate its header, isOpen() tells whether it succeeded
+		IdxFile( std::string fileName );
+		~IdxFile( );
+		inline bool isOpen( ) const {
+			return this->data != nullptr;
+		}
+		// Dimensions, i.e. N (x H x W)
+		inline const vector<int>& getDims( ) const {
+			return this->dims;
+		}
+		inline size_t getCount( ) const {
+			return ( this->dims.empty() )? 0 : this->dims[0];
+		}
+		inline const uchar* getData( ) const {
+			return this->data;
+		}
+		// H x W header of the n-th item
+		Mat getItem( size_t n ) const;
+		// N x H x W header of all the items
+		Mat getTensor( ) const;
+};
+
+// Reproducible sampler of non-blank square patches from grayscale (CV_8UC1) images.
+// Patch n depends only on the seed and n (counter-based random numbers), so
+// patches could be drawn in any order and by any number of threads.
+class PatchSampler {
 	private:
-		static int reverseInt(int i);
+		// Side of the blocks whose occupancy is recorded for every image
+		static const int BLOCK_SIZE = 8;
 
+		// Headers of the images, which share the pixels with the caller's dataset
+		const vector<Mat> dataset;
+		// Integral images of the blocks holding a non-zero pixel (1/16 byte per
+		// pixel), used to reject the blank patches without reading them
+		vector<Mat> occupancy;
+		// Images big enough to contain a patch
+		vector<size_t> images;
+		int patchSize;
+		uint64_t seed;
+		uint64_t counter;
+
+		static uint64_t random(uint64_t seed, uint64_t n, uint64_t attempt);
+		static int countBlocks(const Mat &sum, int top, int left, int bottom, int right);
+		bool isBlank(size_t k, int i, int j) const;
+
+	public:
+		PatchSampler( ) = delete;
+		// The images are shared, not copied, so the sampler and the returned
+		// patches stay valid even when the caller's vector goes away
+		PatchSampler(const vector<Mat> &dataset, int patchSize, uint64_t seed);
+		// Patch number n as a view into its image
+		Mat getPatch(uint64_t n) const;
+		// Next patches as views into their images
+		void nextBatch(vector<Mat> &batch, size_t batchSize);
+		// Next patches copied into the rows of a batchSize x (patchSize * patchSize) matrix
+		void nextBatch(Mat &batch, size_t batchSize, int numOfThreads = 1);
+		// Number of patches drawn so far
+		inline uint64_t getCounter( ) const {
+			return this->counter;
+		}
+};
+
+// Cache of preprocessed images or patches stored as one contiguous binary file.
+// The file is keyed by a hash of the source and the preprocessing parameters,
+// a cache with a different key is rebuilt. The items are headers pointing into
+// the read-only mapping and are valid only as long as the DatasetCache exists.
+class DatasetCache {
+	private:
+		void *mapping;
+		size_t size;
+		vector<Mat> items;
+
+		void unmap();
+		bool map(std::string fileName, uint64_t key);
+
+	public:
+		DatasetCache( );
+		DatasetCache( const DatasetCache& ) = delete;
+		DatasetCache& operator=( const DatasetCache& ) = delete;
+		~DatasetCache( );
+		// Map the cache file if it matches the key, otherwise let the producer
+		// compute the items, write them to the cache file and map it
+		bool open(std::string fileName, uint64_t key, std::function<void(vector<Mat>&)> producer);
+		// Preprocessed images of the directory (see Dataset::loadDataset)
+		bool loadDataset(std::string fileName, std::string path, int numOfThreads = 0, double scale = 1.0);
+		inline bool isOpen( ) const {
+			return this->mapping != nullptr;
+		}
+		inline const vector<Mat>& getItems( ) const {
+			return this->items;
+		}
+		// Write the items into the cache file
+		static bool write(std::string fileName, uint64_t key, const vector<Mat> &items);
+		// Hash of the image listing (names, sizes, modification times) and the parameters
+		static uint64_t calculateKey(std::string path, std::string parameters);
+};
+
+// Dataset class is used to load and prepare data for the further usage
+class Dataset {
 	public:
-		static void loadDataset(std::string path, std::vector<Mat> &dataset);
+		// List image files (sorted by name) of the directory
+		static vector<string> listImages(std::string path);
+		// Images are decoded and converted to grayscale by numOfThreads threads
+		// (0 means one per core), optionally downscaled by the scale factor.
+		// They are returned in the order of sorted file names, unreadable files are skipped.
+		static void loadDataset(std::string path, std::vector<Mat> &dataset, int numOfThreads = 0, double scale = 1.0);
+		// Same as above, but each image is passed to the consumer as soon as it is
+		// decoded and all the images before it have been passed
+		static void streamDataset(std::string path, std::function<void(Mat&)> consumer, int numOfThreads = 0,
+		                          double scale = 1.0);
+		// Sample patches owning their data (see PatchSampler for the views)
 		static void prepareTrainingSet(
-			std::vector<Mat> &dataset, std::vector<Mat> &trainingSet, long batchSize, int patchSize);
+			std::vector<Mat> &dataset, std::vector<Mat> &trainingSet, long batchSize, int patchSize,
+			uint64_t seed = time(NULL));
 		static void loadMNIST(string filename, vector<cv::Mat> &vec);
+		static void loadMNIST(const IdxFile &file, vector<cv::Mat> &vec);
 		static void loadMNISTLabels(string filename, vector<double> &vec);
 };
 
@@ -0,0 +1,188 @@
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "types.hpp"
+
+using namespace std;
+
+/* Bounded prefetching pipeline. Producer threads prepare the inputs ahead
+   (loading, decoding, patch extraction) while the consumer computes the
+   current one. Input n is prepared by producer(n, item), which returns false
+   when there are no more inputs. The inputs are handed over in order through
+   a lock-free ring by swapping, so the consumer's previous buffer goes back
+   to the producers for reuse and nothing is copied. A thread finding the ring
+   full (or empty) spins shortly and then blocks until the other side wakes it.
+   An exception thrown by the producer ends the inputs before the one being
+   prepared, and is rethrown by pop() once the inputs before it are consumed. */
+template<typename T>
+class InputPipeline {
+	private:
+		struct Slot {
+			// Equal to n when the slot is free for input n,
+			// and to n + 1 when input n is ready in it
+			atomic<uint64_t> sequence;
+			T item;
+		};
+		vector<Slot> ring;
+		function<bool(uint64_t, T&)> producer;
+		vector<thread> threads;
+		atomic<uint64_t> claimed;
+		// Index of the first missing input
+		atomic<uint64_t> end;
+		atomic<bool> stopped;
+		uint64_t consumed;
+		// Times the producers found the ring full and the consumer found it empty
+		atomic<uint64_t> backpressure;
+		atomic<uint64_t> starvation;
+		// Blocked threads, woken whenever a slot or the end changes
+		mutex lock;
+		condition_variable changed;
+		atomic<int> waiting;
+		// Exception of the producer which ended the inputs, under the lock
+		exception_ptr error;
+		uint64_t errorInput;
+
+		// Wait until ready() holds, spinning shortly before blocking
+		template<typename F>
+		void wait( F ready ) {
+			for ( int spin = 0; spin < 64; spin++ ) {
+				if ( ready() ) {
+					return;
+				}
+				this_thread::yield();
+			}
+			unique_lock<mutex> guard( this->lock );
+			this->waiting++;
+			this->changed.wait( guard, ready );
+			this->waiting--;
+		}
+		// Wake the blocked threads, if any
+		void notify( ) {
+			if ( this->waiting > 0 ) {
+				lock_guard<mutex> guard( this->lock );
+				this->changed.notify_all();
+			}
+		}
+		// No input from n on
+		void finish( uint64_t n ) {
+			uint64_t e = this->end.load();
+			while ( n < e && !this->end.compare_exchange_weak(e, n) );
+			this->notify();
+		}
+
+		void produce( ) {
+			T item;
+			for ( uint64_t n = this->claimed++; n < this->end && !this->stopped; n = this->claimed++ ) {
+				bool produced;
+				try {
+					produced = this->producer(n, item);
+				} catch ( ... ) {
+					lock_guard<mutex> guard( this->lock );
+					if ( !this->error || n < this->errorInput ) {
+						this->error = current_exception();
+						this->errorInput = n;
+					}
+					produced = false;
+				}
+				if ( !produced ) {
+					this->finish(n);
+					return;
+				}
+				Slot &slot = this->ring[n % this->ring.size()];
+				if ( slot.sequence.load() != n ) {
+					this->backpressure++;
+					this->wait( [&]( ) { return slot.sequence.load() == n || this->stopped; } );
+					if ( slot.sequence.load() != n ) {
+						return;
+					}
+				}
+				swap(slot.item, item);
+				slot.sequence.store(n + 1);
+				this->notify();
+			}
+		}
+
+	public:
+		InputPipeline( ) = delete;
+		InputPipeline( const InputPipeline& ) = delete;
+		InputPipeline& operator=( const InputPipeline& ) = delete;
+		InputPipeline( function<bool(uint64_t, T&)> producer, size_t capacity = 8, int numOfThreads = 1 )
+			: ring(capacity), producer(producer), claimed(0), end(UINT64_MAX), stopped(false),
+			  consumed(0), backpressure(0), starvation(0), waiting(0), errorInput(0) {
+			for ( size_t s = 0; s < capacity; s++ ) {
+				this->ring[s].sequence = s;
+			}
+			for ( int t = 0; t < numOfThreads; t++ ) {
+				this->threads.push_back(thread(&InputPipeline::produce, this));
+			}
+		}
+		~InputPipeline( ) {
+			this->stop();
+		}
+		// Swap the next input into item, returns false when there are no more
+		// inputs, or rethrows the exception of the producer which ended them
+		bool pop( T &item ) {
+			const uint64_t n = this->consumed;
+			Slot &slot = this->ring[n % this->ring.size()];
+
+			if ( slot.sequence.load() != n + 1 ) {
+				this->starvation++;
+				this->wait( [&]( ) { return slot.sequence.load() == n + 1 || n >= this->end || this->stopped; } );
+				if ( slot.sequence.load() != n + 1 ) {
+					lock_guard<mutex> guard( this->lock );
+					if ( this->error && n >= this->end && n == this->errorInput ) {
+						rethrow_exception( this->error );
+					}
+					return false;
+				}
+			}
+			swap(item, slot.item);
+			slot.sequence.store(n + this->ring.size());
+			this->consumed++;
+			this->notify();
+			return true;
+		}
+		// Swap the next input directly into the data of an input source,
+		// its previous data goes back to the producers
+		bool pop( InputSource<T> &input ) {
+			T item;
+			input.swapData(item);
+			const bool res = this->pop(item);
+			input.swapData(item);
+			return res;
+		}
+		// Stop the producers and wait for them
+		void stop( ) {
+			this->stopped = true;
+			{
+				lock_guard<mutex> guard( this->lock );
+				this->changed.notify_all();
+			}
+			for ( auto &t : this->threads ) {
+				if ( t.joinable() ) {
+					t.join();
+				}
+			}
+		}
+		// Getters
+		inline uint64_t getBackpressure( ) const {
+			return this->backpressure;
+		}
+		inline uint64_t getStarvation( ) const {
+			return this->starvation;
+		}
+		inline uint64_t getConsumed( ) const {
+			return this->consumed;
+		}
+};
+
+#endif /* PIPELINE_HPP_ */
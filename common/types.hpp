@@ -1,8 +1,14 @@
 #ifndef TYPES_HPP_
 #define TYPES_HPP_
 
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
 #include <opencv2/core.hpp>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 
 using namespace cv;
@@ -30,46 +36,240 @@ class DataSource {
 		}
 		// Get value
 		virtual double getValue( size_t i, size_t j, size_t k ) const = 0;
+		// Copy channel k of a window row by row, the sources knowing the type
+		// of their data override it to read the window without a call per value
+		virtual void getWindow( const Rect &window, size_t k, double *out ) const {
+			for ( int i = 0; i < window.height; i++ ) {
+				for ( int j = 0; j < window.width; j++ ) {
+					*out++ = this->getValue( window.y + i, window.x + j, k );
+				}
+			}
+		}
 
 		virtual ~DataSource( ) {
 
 		}
 };
 
+/* Typed element access for the data held by an InputSource, resolved at
+   compile time. Each specialisation gives the element type, the size of the
+   data and an inline at(i, j, k) the compiler sees as a plain array read.
+   Types without a specialisation cannot be used as an input. */
+template<typename T>
+struct InputAccess;
+
+// Untyped 8 bit image, grayscale or the first channel of BGR
+template<>
+struct InputAccess<Mat> {
+	typedef uchar value_type;
+
+	static inline value_type at( const Mat &m, size_t i, size_t j, size_t ) {
+		return m.ptr<uchar>(i)[j * m.channels()];
+	}
+	static inline size_t height( const Mat &m ) {
+		return m.rows;
+	}
+	static inline size_t width( const Mat &m ) {
+		return m.cols;
+	}
+};
+
+// Single channel image of a known element type
+template<typename E>
+struct InputAccess<Mat_<E>> {
+	typedef E value_type;
+
+	static inline value_type at( const Mat_<E> &m, size_t i, size_t j, size_t ) {
+		return m(i,j);
+	}
+	static inline size_t height( const Mat_<E> &m ) {
+		return m.rows;
+	}
+	static inline size_t width( const Mat_<E> &m ) {
+		return m.cols;
+	}
+};
+
+// Interleaved multi-channel image of a known element type
+template<typename E, int n>
+struct InputAccess<Mat_<Vec<E, n>>> {
+	typedef E value_type;
+
+	static inline value_type at( const Mat_<Vec<E, n>> &m, size_t i, size_t j, size_t k ) {
+		return m(i,j)[k];
+	}
+	static inline size_t height( const Mat_<Vec<E, n>> &m ) {
+		return m.rows;
+	}
+	static inline size_t width( const Mat_<Vec<E, n>> &m ) {
+		return m.cols;
+	}
+};
+
+// One double matrix per channel (feature responses)
+template<>
+struct InputAccess<vector<Mat>> {
+	typedef double value_type;
+
+	static inline value_type at( const vector<Mat> &m, size_t i, size_t j, size_t k ) {
+		return m[k].at<double>(i,j);
+	}
+	static inline size_t height( const vector<Mat> &m ) {
+		return ( m.empty() )? 0 : m[0].rows;
+	}
+	static inline size_t width( const vector<Mat> &m ) {
+		return ( m.empty() )? 0 : m[0].cols;
+	}
+};
+
 template<typename T>
 class InputSource : public DataSource {
 	private:
 		T data;
 
 	public:
-		InputSource( );
+		typedef typename InputAccess<T>::value_type value_type;
+
+		InputSource( ) {
+			this->height = 0;
+			this->width = 0;
+		}
 		// Set/get data
 		void setData( T data ) {
 			this->data = data;
+			this->height = InputAccess<T>::height(this->data);
+			this->width = InputAccess<T>::width(this->data);
+		}
+		// Exchange the data without copying, data gets the previous one
+		void swapData( T &data ) {
+			swap(this->data, data);
+			this->height = InputAccess<T>::height(this->data);
+			this->width = InputAccess<T>::width(this->data);
 		}
 		T& getData( ) {
 			return this->data;
 		}
+		// Get typed value, for callers knowing the input type
+		inline value_type at( size_t i, size_t j, size_t k = 0 ) const {
+			return InputAccess<T>::at(this->data, i, j, k);
+		}
 		// Get value
 		double getValue( size_t i, size_t j, size_t k = 0 ) const override {
-			if ( is_same<T, Mat>::value ) {
-				auto m = static_cast<Mat>(this->data);
-				uchar val;
+			return this->at(i, j, k);
+		}
+		void getWindow( const Rect &window, size_t k, double *out ) const override {
+			for ( int i = 0; i < window.height; i++ ) {
+				for ( int j = 0; j < window.width; j++ ) {
+					*out++ = InputAccess<T>::at(this->data, window.y + i, window.x + j, k);
+				}
+			}
+		}
+};
 
-				if (m.channels() == 1) {
-					// Grayscale value
-					val = m.at<uchar>(i,j);
+enum class TensorLayout {
+	PLANAR,       // K planes of H x W values
+	INTERLEAVED   // H x W pixels of K values
+};
+
+/* Data source storing H x W x K values of type T (uchar, float or double)
+   in one contiguous 64 byte aligned buffer, so reading channel k of a
+   position is a fixed stride load. */
+template<typename T>
+class TensorSource : public DataSource {
+	private:
+		unique_ptr<T, void (*)(void*)> data;
+		size_t channels;
+		TensorLayout layout;
+		// Distance between consecutive columns, rows and channels
+		size_t colStride, rowStride, channelStride;
+
+	public:
+		TensorSource( ) = delete;
+		TensorSource( const TensorSource& ) = delete;
+		TensorSource& operator=( const TensorSource& ) = delete;
+		TensorSource( size_t height, size_t width, size_t channels, TensorLayout layout = TensorLayout::PLANAR )
+			: data(nullptr, free), channels(channels), layout(layout) {
+			void *ptr = nullptr;
+
+			this->height = height;
+			this->width = width;
+			if ( ( width > 0 && channels > 0 && height > SIZE_MAX / sizeof(T) / channels / width ) ||
+			     posix_memalign( &ptr, 64, height * width * channels * sizeof(T) ) != 0 ) {
+				throw bad_alloc();
+			}
+			memset( ptr, 0, height * width * channels * sizeof(T) );
+			this->data.reset( static_cast<T*>(ptr) );
+			if ( layout == TensorLayout::PLANAR ) {
+				this->colStride = 1;
+				this->rowStride = width;
+				this->channelStride = height * width;
+			} else {
+				this->colStride = channels;
+				this->rowStride = width * channels;
+				this->channelStride = 1;
+			}
+		}
+		// Copy a single channel H x W matrix (of any depth, converted to T) into channel k
+		void setChannel( size_t k, const Mat &m ) {
+			if ( k >= this->channels || m.channels() != 1 ||
+			     static_cast<size_t>(m.rows) != this->height || static_cast<size_t>(m.cols) != this->width ) {
+				throw invalid_argument( "TensorSource::setChannel: expected a single channel matrix of the tensor size" );
+			}
+			Mat src = m;
+			if ( m.type() != DataType<T>::type ) {
+				m.convertTo( src, DataType<T>::type );
+			}
+			if ( src.depth() != DataType<T>::depth ) {
+				throw invalid_argument( "TensorSource::setChannel: unsupported matrix depth" );
+			}
+			for ( size_t i = 0; i < this->height; i++ ) {
+				const T *row = src.ptr<T>(i);
+				T *dst = this->data.get() + i * this->rowStride + k * this->channelStride;
+				if ( this->colStride == 1 ) {
+					memcpy( dst, row, this->width * sizeof(T) );
 				} else {
-					// BGR value
-					Vec3b v = m.at<Vec3b>(i,j);
-					val = v[0];
+					for ( size_t j = 0; j < this->width; j++ ) {
+						dst[j * this->colStride] = row[j];
+					}
+				}
+			}
+		}
+		// Copy one matrix per channel
+		void setData( const vector<Mat> &m ) {
+			for ( size_t k = 0; k < m.size() && k < this->channels; k++ ) {
+				this->setChannel( k, m[k] );
+			}
+		}
+		// Getters
+		inline size_t getChannels( ) const {
+			return this->channels;
+		}
+		inline TensorLayout getLayout( ) const {
+			return this->layout;
+		}
+		inline T* getData( ) {
+			return this->data.get();
+		}
+		inline const T* getData( ) const {
+			return this->data.get();
+		}
+		inline size_t getOffset( size_t i, size_t j, size_t k ) const {
+			return i * this->rowStride + j * this->colStride + k * this->channelStride;
+		}
+		inline T at( size_t i, size_t j, size_t k = 0 ) const {
+			return this->data.get()[this->getOffset(i, j, k)];
+		}
+		// Get value
+		double getValue( size_t i, size_t j, size_t k = 0 ) const override {
+			return this->at(i, j, k);
+		}
+		void getWindow( const Rect &window, size_t k, double *out ) const override {
+			for ( int i = 0; i < window.height; i++ ) {
+				const T *row = this->data.get() + this->getOffset(window.y + i, window.x, k);
+				for ( int j = 0; j < window.width; j++ ) {
+					*out++ = row[j * this->colStride];
 				}
-				return val;
-			} else if ( is_same<T, vector<Mat>>::value ) {
-				auto m = static_cast<vector<Mat> >(this->data);
-				return m[k].at<double>(i,j);
 			}
-			return 0.0;
 		}
 };
 
@@ -0,0 +1,123 @@
+#include "checkpoint.hpp"
+
+#include <cstdio>
+#include <sstream>
+
+RegionCheckpoint::RegionCheckpoint( Region *region, std::string fileName, size_t compactionInterval, RegionFileFormat format ) {
+	this->region			 = region;
+	this->fileName			 = fileName;
+	this->compactionInterval = compactionInterval;
+	this->format			 = ( format == RegionFileFormat::TEXT )? RegionFileFormat::BINARY : format;
+	this->numOfDeltas		 = 0;
+
+	// Continue the generations of an existing checkpoint
+	RegionFileHeader header;
+	this->generation = ( readRegionFileHeader( fileName, header ) )? header.generation : 0;
+}
+
+// FNV-1a hash of the column's boost and all its synapses
+uint64_t RegionCheckpoint::calculateSignature( Column &column ) const {
+	uint64_t hash = 14695981039346656037ULL;
+	auto mix = [&hash]( uint64_t value ) {
+		hash = (hash ^ value) * 1099511628211ULL;
+	};
+	double boost = column.getBoost();
+	uint64_t boostBits;
+
+	memcpy( &boostBits, &boost, sizeof(boostBits) );
+	mix( boostBits );
+	column.getProximalDendrite().forEachSynapse( [&]( const SynapseView &syn ) {
+		float permanence = syn.getPermanence();
+		uint32_t permanenceBits;
+
+		memcpy( &permanenceBits, &permanence, sizeof(permanenceBits) );
+		mix( (static_cast<uint64_t>(syn.getI()) << 32) | syn.getJ() );
+		mix( (static_cast<uint64_t>(syn.getK()) << 32) | permanenceBits );
+		mix( ( syn.isExcitatory() )? 'e' : 'i' );
+	} );
+	return hash;
+}
+
+std::string RegionCheckpoint::getDeltaFileName( size_t n ) const {
+	stringstream ss;
+	ss << this->fileName << "." << n;
+	return ss.str();
+}
+
+void RegionCheckpoint::save( ) {
+	const size_t height = this->region->getHeight();
+	const size_t width = this->region->getWidth();
+
+	if ( this->signatures.size() != height * width || this->numOfDeltas >= this->compactionInterval ) {
+		this->compact();
+		return;
+	}
+
+	// Collect the columns changed since the last checkpoint. The revision also
+	// changes when the synapses were only read through getSynapses(), so
+	// the signature tells whether a marked column really changed.
+	vector<uint32_t> changed;
+	for ( size_t n = 0; n < height * width; n++ ) {
+		Column &column = (*this->region)[n / width][n % width];
+		const uint64_t revision = column.getProximalDendrite().getRevision();
+
+		if ( revision == this->revisions[n] && column.getBoost() == this->boosts[n] ) {
+			continue;
+		}
+		this->revisions[n] = revision;
+		this->boosts[n] = column.getBoost();
+		const uint64_t signature = this->calculateSignature( column );
+		if ( signature != this->signatures[n] ) {
+			this->signatures[n] = signature;
+			changed.push_back( n );
+		}
+	}
+	if ( changed.empty() ) {
+		return;
+	}
+
+	// A delta file appears only once complete (see writeRegionFile)
+	this->region->saveDelta( this->getDeltaFileName( this->numOfDeltas + 1 ), changed, this->format, this->generation );
+	this->numOfDeltas++;
+}
+
+void RegionCheckpoint::compact( ) {
+	const size_t height = this->region->getHeight();
+	const size_t width = this->region->getWidth();
+
+	// The new snapshot replaces the old one before the deltas are removed, so an
+	// interrupted compaction leaves either the old snapshot with all its deltas
+	// or the new snapshot with deltas of the old generation, which are ignored
+	this->generation++;
+	this->region->save( this->fileName, this->format, this->generation );
+	for ( size_t n = 1; std::remove( this->getDeltaFileName( n ).c_str() ) == 0; n++ );
+
+	this->revisions.resize( height * width );
+	this->boosts.resize( height * width );
+	this->signatures.resize( height * width );
+	for ( size_t n = 0; n < height * width; n++ ) {
+		Column &column = (*this->region)[n / width][n % width];
+		this->revisions[n] = column.getProximalDendrite().getRevision();
+		this->boosts[n] = column.getBoost();
+		this->signatures[n] = this->calculateSignature( column );
+	}
+	this->numOfDeltas = 0;
+}
+
+void RegionCheckpoint::load( Region *region, std::string fileName ) {
+	RegionFileHeader snapshot, delta;
+
+	region->load( fileName );
+	if ( !readRegionFileHeader( fileName, snapshot ) ) {
+		return;
+	}
+	// Replay the deltas until the first one missing or of another generation
+	for ( size_t n = 1; ; n++ ) {
+		stringstream ss;
+		ss << fileName << "." << n;
+		if ( !readRegionFileHeader( ss.str(), delta ) || delta.generation != snapshot.generation ) {
+			break;
+		}
+		region->load( ss.str() );
+	}
+}
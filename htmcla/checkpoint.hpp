@@ -0,0 +1,56 @@
+#ifndef CHECKPOINT_HPP_
+#define CHECKPOINT_HPP_
+
+#include "htmcla/htmcla.hpp"
+#include "htmcla/region.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Incremental checkpoints of a region. The first checkpoint is a full snapshot
+   written to fileName, every following one is a delta (fileName.1, fileName.2, ...)
+   holding only the columns whose boost or synapses changed since the previous
+   checkpoint. A column is only signed again when its boost or the revision of
+   its synapses changed, and then written if its signature changed, so the
+   synapses of the untouched columns are not visited at all. After
+   compactionInterval deltas the snapshot is rewritten and the deltas are
+   dropped. Every snapshot gets a new generation number, which its deltas
+   record too, so the deltas left over by an interrupted compaction belong to
+   an older generation and are not replayed. */
+class RegionCheckpoint {
+	private:
+		Region *region;
+		std::string fileName;
+		size_t compactionInterval;
+		RegionFileFormat format;
+		size_t numOfDeltas;
+		uint64_t generation;
+		// Revision of the synapses, boost and signature of every column
+		// as of the last checkpoint
+		vector<uint64_t> revisions;
+		vector<double> boosts;
+		vector<uint64_t> signatures;
+
+		uint64_t calculateSignature( Column &column ) const;
+		std::string getDeltaFileName( size_t n ) const;
+
+	public:
+		RegionCheckpoint( ) = delete;
+		RegionCheckpoint( Region *region, std::string fileName, size_t compactionInterval = 16,
+		                  RegionFileFormat format = RegionFileFormat::BINARY );
+		// Write a delta, or a full snapshot if it is due
+		void save( );
+		// Write a full snapshot of the next generation and remove all the deltas
+		void compact( );
+		// Load the snapshot and replay its deltas in order
+		static void load( Region *region, std::string fileName );
+		// Getters
+		inline size_t getNumOfDeltas( ) const {
+			return this->numOfDeltas;
+		}
+};
+
+#endif /* CHECKPOINT_HPP_ */
@@ -1,6 +1,9 @@
 #include "column.hpp"
 #include "htmcla.hpp"
 
+#include <climits>
+#include <cstdint>
+
 Column::Column() {
 	this->ci = -1;
 	this->cj = -1;
@@ -9,18 +12,19 @@ Column::Column() {
     this->boost = 1.0;
     this->overlapity = 0.0;
     this->activity = 0.0;
+    this->rfChannels = 0;
+    this->rfRevision = UINT64_MAX;
 }
 
 double Column::calculateOverlap( bool isDistanceDependent, double alpha ) {
 	double overlap = 0.0;
-	auto *synapses = proximal.getSynapses();
 
 	if ( !isDistanceDependent ) {
-		for ( auto syn : (*synapses) ) {
+		this->proximal.forEachSynapse( [&]( const SynapseView &syn ) {
 			if ( syn.isExcitatory() && syn.isConnected() ) {
 				overlap += syn.getInputValue( );
 			}
-		}
+		} );
 	} else {
 		// TODO
 	}
@@ -29,50 +33,75 @@ double Column::calculateOverlap( bool isDistanceDependent, double alpha ) {
 
 double Column::calculateInhibition( Column** columns, double alpha ) {
 	double inhibition = 0.0;
-	auto *synapses = this->proximal.getSynapses();
 
-	for ( auto syn : (*synapses) ) {
+	this->proximal.forEachSynapse( [&]( const SynapseView &syn ) {
 		if ( syn.isInhibitory() && syn.isConnected() ) {
 			inhibition += (columns[syn.getI()][syn.getJ()].getOverlap() - this->getOverlap());
 		}
-	}
+	} );
 	return inhibition;
 }
 
 double Column::calculateRFRadius( ) {
-	auto *synapses = this->proximal.getSynapses();
 	int mini = 1000000, maxi = 0;
 	int minj = 1000000, maxj = 0;
 
-	if ( synapses->size() > 0 ) {
-		for ( auto syn : (*synapses) ) {
+	if ( this->proximal.getNumOfSynapses() > 0 ) {
+		this->proximal.forEachSynapse( [&]( const SynapseView &syn ) {
 			if ( syn.isExcitatory() && syn.isConnected() ) {
-			   auto ii = syn.getI( );
-			   auto jj = syn.getJ( );
+			   int ii = syn.getI( );
+			   int jj = syn.getJ( );
 
 			   if ( ii < mini ) mini = ii;
 			   if ( ii > maxi ) maxi = ii;
 			   if ( jj < minj ) minj = jj;
 			   if ( jj > maxj ) maxj = jj;
 			}
-		}
+		} );
 		return ((maxi - mini) + (maxj - minj) + 2) / 4;
 	}
 	return 0.0;
 }
 
 int Column::countConnectedSynapses( ) {
-	auto *synapses = this->proximal.getSynapses();
 	int res = 0;
 
-	for ( auto syn : (*synapses) ) {
+	this->proximal.forEachSynapse( [&]( const SynapseView &syn ) {
 		if ( syn.isExcitatory() && syn.isConnected() ) {
 			res++;
 		}
-	}
+	} );
 	return res;
 }
 
+// Bounding box of the connected excitatory synapses, empty if there are none,
+// optionally with the number of input channels they read
+Rect Column::calculateRFBoundingBox( size_t *channels ) {
+	int mini = INT_MAX, maxi = -1;
+	int minj = INT_MAX, maxj = -1;
+	size_t maxk = 0;
+
+	this->proximal.forEachSynapse( [&]( const SynapseView &syn ) {
+		if ( syn.isExcitatory() && syn.isConnected() ) {
+		   int ii = syn.getI( );
+		   int jj = syn.getJ( );
+
+		   if ( ii < mini ) mini = ii;
+		   if ( ii > maxi ) maxi = ii;
+		   if ( jj < minj ) minj = jj;
+		   if ( jj > maxj ) maxj = jj;
+		   if ( syn.getK() + 1 > maxk ) maxk = syn.getK() + 1;
+		}
+	} );
+	if ( channels != nullptr ) {
+		*channels = maxk;
+	}
+	if ( maxi < 0 ) {
+		return Rect();
+	}
+	return Rect( minj, mini, maxj - minj + 1, maxi - mini + 1 );
+}
+
 void Column::addCell( Cell c ) {
 	cells.push_back(c);
 }
@@ -150,20 +179,31 @@ double Column::getActivity( ) {
 	return this->activity;
 }
 
-Mat Column::getReceptiveField( ) {
-	const size_t inputHeight = 16;
-	const size_t inputWidth = 16;
+Mat Column::getReceptiveField( size_t inputHeight, size_t inputWidth ) {
 	Mat res = Mat::zeros( inputHeight, inputWidth, CV_16UC1 );
-	auto *synapses = this->proximal.getSynapses();
 
-	for ( auto syn : (*synapses) ) {
+	this->proximal.forEachSynapse( [&]( const SynapseView &syn ) {
 		if ( syn.isExcitatory() && syn.isConnected() ) {
 			res.at<uint16_t>(syn.getI(),syn.getJ()) = 1;
 		}
-	}
+	} );
 	return res;
 }
 
+// Cached bounding box, recalculated only after the synapses could have changed
+const Rect& Column::getRFBoundingBox( ) {
+	if ( this->rfRevision != this->proximal.getRevision() ) {
+		this->rfBox = this->calculateRFBoundingBox( &this->rfChannels );
+		this->rfRevision = this->proximal.getRevision();
+	}
+	return this->rfBox;
+}
+
+size_t Column::getRFChannels( ) {
+	this->getRFBoundingBox( );
+	return this->rfChannels;
+}
+
 DendriteSegment& Column::getProximalDendrite( ) {
 	return this->proximal;
 }
@@ -26,15 +26,34 @@ class Column {
 		double overlapity;
 		// Activity duty cycle
 		double activity;
+		// Connected receptive field bounding box and number of input channels,
+		// valid for the given revision of the proximal segment
+		Rect rfBox;
+		size_t rfChannels;
+		uint64_t rfRevision;
 
 	public:
 		// Default constructor
 		Column( );
 		// Calculate
 		double calculateOverlap( bool isDistanceDependent = false, double alpha = 0.0 );
+		// Overlap with the input read through an accessor whose at(i, j, k)
+		// is inlined into the loop, e.g. a window of the input copied by Region
+		template<typename Input>
+		double calculateInputOverlap( const Input &input ) const {
+			double overlap = 0.0;
+
+			this->proximal.forEachSynapse( [&]( const SynapseView &syn ) {
+				if ( syn.isExcitatory() && syn.isConnected() ) {
+					overlap += input.at( syn.getI(), syn.getJ(), syn.getK() );
+				}
+			} );
+			return overlap;
+		}
 		double calculateInhibition( Column** columns, double alpha = 0.0 );
 		double calculateRFRadius( );
 		int countConnectedSynapses( );
+		Rect calculateRFBoundingBox( size_t *channels = nullptr );
 		// Setters
 		void addCell( Cell c );
 		void addSynapse( Synapse s );
@@ -59,7 +78,9 @@ class Column {
 		double getBoost( );
 		double getOverlapity( );
 		double getActivity( );
-		Mat getReceptiveField( );
+		Mat getReceptiveField( size_t inputHeight, size_t inputWidth );
+		const Rect& getRFBoundingBox( );
+		size_t getRFChannels( );
 		DendriteSegment& getProximalDendrite( );
 };
 
@@ -1,12 +1,30 @@
 #include "dendrite.hpp"
 
+// The segment owns its synapses from now on, the mapped file is not used anymore
+void DendriteSegment::copyMappedSynapses( ) {
+	vector<Synapse> synapses;
+
+	synapses.reserve( this->mapped.size );
+	this->forEachSynapse( [&]( const SynapseView &syn ) {
+		Synapse synapse(syn.getI(), syn.getJ(), syn.getK(), syn.getDataSource(), syn.getType());
+		synapse.setPermanence(syn.getPermanence());
+		synapses.push_back(synapse);
+	} );
+	this->synapses = make_shared<vector<Synapse> >( std::move(synapses) );
+	this->mapped.coordinates = nullptr;
+	this->mapped.types = nullptr;
+	this->mapped.permanences = nullptr;
+	this->mapped.qpermanences = nullptr;
+	this->mapped.size = 0;
+}
+
 /* This routine returns the number of connected synapses on segment s
    that are active due to the given state at time t is greater than
    activationThreshold. The parameter state can be activeState, or learnState. */
 bool DendriteSegment::getActiveState( int t, CellState state ) const {
 	double activity;
 
-	for ( auto syn : this->synapses ) {
+	for ( auto syn : *this->synapses ) {
 		if ( syn.isConnected() ) {
             // Compute the number of connected synapses on segment s
             // that are active due to the given state at time t
@@ -3,35 +3,117 @@
 
 #include "common/types.hpp"
 #include "htmcla.hpp"
+#include "regionfile.hpp"
 #include "synapse.hpp"
 
+#include <cstdint>
+#include <memory>
 #include <vector>
 
 using namespace std;
 
+// Read-only synapse arrays of a memory mapped region file (see regionfile.hpp)
+struct SynapseArrays {
+	const uint32_t *coordinates;
+	const uint8_t *types;
+	const float *permanences;
+	const uint16_t *qpermanences;
+	size_t size;
+	DataSource *dataSource;
+};
+
 class DendriteSegment {
 	private:
-		vector<Synapse> synapses;
+		// Copies of a segment share the synapses until one of them modifies them
+		shared_ptr<vector<Synapse> > synapses;
 		double activationThreshold;
+		// Synapses used in place of the vector above when the segment is mapped
+		SynapseArrays mapped;
+		// Incremented whenever the synapses may have been modified
+		uint64_t revision;
+
+		// Copy the mapped synapses into the vector, so they could be modified
+		void copyMappedSynapses( );
 
 	public:
 		DendriteSegment( ) {
+			this->synapses = make_shared<vector<Synapse> >();
 			this->activationThreshold = 0.0;
+			this->revision = 0;
+			this->mapped.coordinates = nullptr;
+			this->mapped.types = nullptr;
+			this->mapped.permanences = nullptr;
+			this->mapped.qpermanences = nullptr;
+			this->mapped.size = 0;
+			this->mapped.dataSource = nullptr;
 		}
 		// Setters
 		inline void addSynapse( Synapse s ) {
-			this->synapses.push_back(s);
+			this->detach();
+			this->synapses->push_back(s);
+			this->revision++;
 		}
 		inline void setActivationThreshold( double activationThreshold ) {
 			this->activationThreshold = activationThreshold;
 		}
-		// Getters
+		inline void setMappedSynapses( const SynapseArrays &mapped ) {
+			this->synapses = make_shared<vector<Synapse> >();
+			this->mapped = mapped;
+			this->revision++;
+		}
+		inline void setMappedDataSource( DataSource *dataSource ) {
+			this->mapped.dataSource = dataSource;
+		}
+		// Take a private copy of the synapses shared with other segments,
+		// or mapped from a region file, called before every modification
+		inline void detach( ) {
+			if ( this->isMapped() ) {
+				this->copyMappedSynapses();
+			} else if ( this->synapses.use_count() > 1 ) {
+				this->synapses = make_shared<vector<Synapse> >( *this->synapses );
+			}
+		}
+		// Getters (the returned vector may be modified, so it is detached first,
+		// and it must not be kept across copying of the segment)
 		inline vector<Synapse>* getSynapses( ) {
-			return &(this->synapses);
+			this->detach();
+			this->revision++;
+			return this->synapses.get();
 		}
 		inline double getActivationThreshold( ) const {
 			return this->activationThreshold;
 		}
+		inline bool isMapped( ) const {
+			return this->mapped.coordinates != nullptr;
+		}
+		inline uint64_t getRevision( ) const {
+			return this->revision;
+		}
+		inline size_t getNumOfSynapses( ) const {
+			return ( this->isMapped() )? this->mapped.size : this->synapses->size();
+		}
+		// Visit all the synapses regardless of where they are stored, as views
+		// (the mapped synapses were validated with the region file)
+		template<typename F>
+		inline void forEachSynapse( F f ) const {
+			if ( !this->isMapped() ) {
+				for ( const auto &syn : *this->synapses ) {
+					f( SynapseView(syn) );
+				}
+				return;
+			}
+			for ( size_t n = 0; n < this->mapped.size; n++ ) {
+				const uint32_t *c = this->mapped.coordinates + 3 * n;
+				const float permanence = ( this->mapped.qpermanences != nullptr )?
+					static_cast<float>(this->mapped.qpermanences[n] / REGION_FILE_QUANTIZATION_SCALE) : this->mapped.permanences[n];
+
+				if ( this->mapped.types[n] == 'e' ) {
+					f( SynapseView(c[0], c[1], c[2], permanence, this->mapped.dataSource, SynapseType::EXCITATORY) );
+				} else {
+					f( SynapseView(c[0], c[1], c[2], permanence, nullptr, SynapseType::INHIBITORY) );
+				}
+			}
+		}
 		bool getActiveState( int t, CellState state ) const;
 };
 
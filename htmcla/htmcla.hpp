@@ -41,4 +41,21 @@ enum class CellState {
 	LEARN_STATE
 };
 
+// Region file could be stored as human readable text (export only, it loses
+// the k coordinate and the number of cells per column) or as a binary file
+// with permanences kept either as floats or quantized to 16 bits
+enum class RegionFileFormat {
+	TEXT,
+	BINARY,
+	BINARY_QUANTIZED
+};
+
+// Region could be loaded into its own memory, or mapped read-only from
+// a binary region file and shared with the other processes (a column
+// modifying its synapses copies them out of the mapped file first)
+enum class RegionLoadMode {
+	COPY,
+	MAPPED
+};
+
 #endif /* HTMCLA_HPP_ */
@@ -1,20 +1,46 @@
 #include "htmcla.hpp"
 #include "region.hpp"
+#include "regionfile.hpp"
 
+#include <cmath>
 #include <fstream>
+#include <iterator>
+#include <thread>
+#include <zlib.h>
 
 // Constructor
 Region::Region( size_t height, size_t width, size_t cellsPerColumn ) {
+	this->height  = 0;
+	this->columns = nullptr;
 	this->init(height, width, cellsPerColumn);
 }
 
+Region::~Region( ) {
+	this->releaseColumns();
+}
+
+void Region::releaseColumns( ) {
+	if ( this->columns == nullptr ) {
+		return;
+	}
+	for ( size_t i = 0; i < this->height; i++ ) {
+		delete[] this->columns[i];
+	}
+	delete[] this->columns;
+	this->columns = nullptr;
+}
+
 // Initialize region (without any connections)
 void Region::init( size_t height, size_t width, size_t cellsPerColumn ) {
+	this->releaseColumns();
 	this->height		 = height;
 	this->width			 = width;
 	this->cellsPerColumn = cellsPerColumn;
     this->columns		 = new Column*[this->height];
     this->dataSource	 = nullptr;
+    this->mapping.reset();
+    // The tiles drawn for the previous columns are not valid anymore
+    this->canvas.release();
 
     // Create column grid
     for ( size_t i = 0; i < this->height; i++ ) {
@@ -47,12 +73,57 @@ void Region::setDataSource( DataSource *src, double alpha ) {
         for ( size_t j = 0; j < this->width; j++ ) {
             // Set column's center over input
         	this->columns[i][j].setCenter( dh + di * i / oci, dw + dj * j / ocj );
+        	// Mapped synapses get their data source from the segment
+        	if ( this->mapping ) {
+        		this->columns[i][j].getProximalDendrite().setMappedDataSource( src );
+        	}
         }
     }
 }
 
 // Save region
-void Region::save( std::string fileName ) {
+void Region::save( std::string fileName, RegionFileFormat format, uint64_t generation ) {
+	if ( format == RegionFileFormat::TEXT ) {
+		this->saveText( fileName );
+	} else {
+		this->saveBinary( fileName, format == RegionFileFormat::BINARY_QUANTIZED, nullptr, generation );
+	}
+}
+
+// Save only the given columns (row-major indices) as a binary delta file
+void Region::saveDelta( std::string fileName, const vector<uint32_t> &columns, RegionFileFormat format, uint64_t generation ) {
+	this->saveBinary( fileName, format == RegionFileFormat::BINARY_QUANTIZED, &columns, generation );
+}
+
+// Load region, the file format is detected automatically.
+// Only binary files could be mapped, such region copies the synapses of a
+// column only when they are modified.
+void Region::load( std::string fileName, RegionLoadMode mode ) {
+	if ( mode == RegionLoadMode::MAPPED ) {
+		this->loadMapped( fileName );
+		return;
+	}
+
+	ifstream myfile(fileName.c_str(), ios::binary);
+	RegionFileHeader header;
+
+	if ( !myfile.is_open() ) {
+		cout << "Failure: unable to open a file to load the region" << endl;
+		return;
+	}
+	memset( &header, 0, sizeof(header) );
+	myfile.read( reinterpret_cast<char*>(&header), sizeof(header) );
+	myfile.close();
+
+	if ( isRegionFileHeader( header ) ) {
+		this->loadBinary( fileName );
+	} else {
+		this->loadText( fileName );
+	}
+}
+
+// Save region as text
+void Region::saveText( std::string fileName ) {
 	ofstream myfile(fileName.c_str());
 
 	if ( myfile.is_open() ) {
@@ -61,13 +132,13 @@ void Region::save( std::string fileName ) {
 		// Save information about the columns
 		for ( size_t i = 0; i < this->height; i++ ) {
 			for ( size_t j = 0; j < this->width; j++ ) {
-				auto *synapses = this->columns[i][j].getSynapses();
-				myfile << i << " " << j << " " << this->columns[i][j].getBoost() << " " << synapses->size() << " ";
+				auto &proximal = this->columns[i][j].getProximalDendrite();
+				myfile << i << " " << j << " " << this->columns[i][j].getBoost() << " " << proximal.getNumOfSynapses() << " ";
 				// Save information about synapses
-				for ( auto syn : (*synapses) ) {
+				proximal.forEachSynapse( [&]( const SynapseView &syn ) {
 					myfile << (( syn.isExcitatory() )? 'e' : 'i') << " " <<
-						syn.getI() << " " << syn.getJ() << " " << syn.getPermanence();
-				}
+						syn.getI() << " " << syn.getJ() << " " << syn.getPermanence() << " ";
+				} );
 				myfile << endl;
 			}
 		}
@@ -77,8 +148,254 @@ void Region::save( std::string fileName ) {
 	}
 }
 
-// Load region
-void Region::load( std::string fileName ) {
+// Save region (or only the given columns) as binary file
+void Region::saveBinary( std::string fileName, bool quantize, const vector<uint32_t> *columns, uint64_t generation ) {
+	RegionFileHeader header;
+	vector<char> payload;
+
+	this->serializeBinary( quantize, columns, header, payload );
+	header.generation = generation;
+	if ( !writeRegionFile( fileName, header, payload, false, false ) ) {
+		cout << "Failure: unable to open file to save the region" << endl;
+	}
+}
+
+// Save region as binary file on a background thread. The region state is
+// captured before returning by a clone, which shares the synapses until the
+// caller modifies them, so only the column grid is copied here and the region
+// is serialized in the background. The future becomes true once the file is
+// written and synced to the disk. It could be dropped without waiting, but
+// the file is then only complete if the process does not exit before.
+future<bool> Region::saveAsync( std::string fileName, RegionFileFormat format, bool compress ) {
+	shared_ptr<Region> snapshot = make_shared<Region>( 0, 0 );
+	shared_ptr<promise<bool> > written = make_shared<promise<bool> >();
+	const bool quantize = format == RegionFileFormat::BINARY_QUANTIZED;
+
+	this->clone( snapshot.get() );
+	future<bool> result = written->get_future();
+	thread( [fileName, snapshot, written, quantize, compress]( ) {
+		try {
+			RegionFileHeader header;
+			vector<char> payload;
+
+			snapshot->serializeBinary( quantize, nullptr, header, payload );
+			written->set_value( writeRegionFile( fileName, header, payload, compress, true ) );
+		} catch ( ... ) {
+			written->set_exception( current_exception() );
+		}
+	} ).detach();
+	return result;
+}
+
+// Fill the header (except for the checksum) and the payload of a binary
+// region file (see regionfile.hpp for the layout)
+void Region::serializeBinary( bool quantize, const vector<uint32_t> *columns, RegionFileHeader &header, vector<char> &payload ) {
+	const size_t numOfColumns = ( columns != nullptr )? columns->size() : this->height * this->width;
+	size_t numOfSynapses = 0;
+
+	for ( size_t c = 0; c < numOfColumns; c++ ) {
+		const size_t n = ( columns != nullptr )? (*columns)[c] : c;
+		numOfSynapses += this->columns[n / this->width][n % this->width].getProximalDendrite().getNumOfSynapses();
+	}
+
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, REGION_FILE_MAGIC, sizeof(REGION_FILE_MAGIC) );
+	header.version		  = REGION_FILE_VERSION;
+	header.flags		  = ( quantize )? REGION_FILE_QUANTIZED : 0;
+	header.height		  = this->height;
+	header.width		  = this->width;
+	header.cellsPerColumn = this->cellsPerColumn;
+	header.numOfSynapses  = numOfSynapses;
+	if ( columns != nullptr ) {
+		header.flags		|= REGION_FILE_DELTA;
+		header.numOfColumns  = numOfColumns;
+	}
+
+	// Fill all the sections in one buffer, so the file is written at once
+	RegionFileLayout layout( header );
+	payload.assign( layout.end - layout.columns, 0 );
+	char *base = payload.data() - layout.columns;
+	uint32_t *indices = reinterpret_cast<uint32_t*>(base + layout.columns);
+	double *boosts = reinterpret_cast<double*>(base + layout.boosts);
+	uint64_t *offsets = reinterpret_cast<uint64_t*>(base + layout.offsets);
+	uint32_t *coordinates = reinterpret_cast<uint32_t*>(base + layout.coordinates);
+	uint8_t *types = reinterpret_cast<uint8_t*>(base + layout.types);
+	float *permanences = reinterpret_cast<float*>(base + layout.permanences);
+	uint16_t *qpermanences = reinterpret_cast<uint16_t*>(base + layout.permanences);
+	size_t n = 0;
+
+	for ( size_t c = 0; c < numOfColumns; c++ ) {
+		const size_t index = ( columns != nullptr )? (*columns)[c] : c;
+		Column &column = this->columns[index / this->width][index % this->width];
+
+		if ( columns != nullptr ) {
+			indices[c] = index;
+		}
+		boosts[c] = column.getBoost();
+		offsets[c] = n;
+		column.getProximalDendrite().forEachSynapse( [&]( const SynapseView &syn ) {
+			coordinates[3 * n]	   = syn.getI();
+			coordinates[3 * n + 1] = syn.getJ();
+			coordinates[3 * n + 2] = syn.getK();
+			types[n] = ( syn.isExcitatory() )? 'e' : 'i';
+			if ( quantize ) {
+				qpermanences[n] = static_cast<uint16_t>(syn.getPermanence() * REGION_FILE_QUANTIZATION_SCALE + 0.5);
+			} else {
+				permanences[n] = syn.getPermanence();
+			}
+			n++;
+		} );
+	}
+	offsets[numOfColumns] = n;
+}
+
+// Load region from binary file. A delta file is applied to the current region.
+void Region::loadBinary( std::string fileName ) {
+	ifstream myfile(fileName.c_str(), ios::binary);
+	RegionFileHeader header;
+
+	if ( !myfile.is_open() ) {
+		cout << "Failure: unable to open a file to load the region" << endl;
+		return;
+	}
+	myfile.seekg( 0, ios::end );
+	const size_t fileSize = myfile.tellg();
+	myfile.seekg( 0, ios::beg );
+	memset( &header, 0, sizeof(header) );
+	myfile.read( reinterpret_cast<char*>(&header), sizeof(header) );
+	if ( !isRegionFileHeader( header ) || header.version != REGION_FILE_VERSION ) {
+		cout << "Failure: unsupported region file format" << endl;
+		return;
+	}
+	// The counts are checked before sizing the payload from them
+	if ( !isRegionFileSizeValid( header, fileSize ) ) {
+		cout << "Failure: region file is corrupted" << endl;
+		return;
+	}
+
+	const bool delta = ( header.flags & REGION_FILE_DELTA ) != 0;
+	if ( delta && ( header.height != this->height || header.width != this->width || this->mapping ) ) {
+		cout << "Failure: region delta does not match the region" << endl;
+		return;
+	}
+
+	// Read all the sections at once
+	RegionFileLayout layout( header );
+	vector<char> payload( layout.end - layout.columns );
+	bool complete;
+	myfile.seekg( layout.columns );
+	if ( header.flags & REGION_FILE_COMPRESSED ) {
+		vector<char> compressed( ( istreambuf_iterator<char>(myfile) ), istreambuf_iterator<char>() );
+		uLongf size = payload.size();
+		complete = uncompress( reinterpret_cast<Bytef*>(payload.data()), &size,
+			reinterpret_cast<const Bytef*>(compressed.data()), compressed.size() ) == Z_OK && size == payload.size();
+	} else {
+		myfile.read( payload.data(), payload.size() );
+		complete = static_cast<size_t>(myfile.gcount()) == payload.size();
+	}
+	const char *base = payload.data() - layout.columns;
+	if ( !complete ||
+	     crc32( 0L, reinterpret_cast<const Bytef*>(payload.data()), payload.size() ) != header.checksum ||
+	     !areRegionFileOffsetsValid( header, base ) || !areRegionFileSynapsesValid( header, base ) ) {
+		cout << "Failure: region file is corrupted" << endl;
+		return;
+	}
+	myfile.close();
+
+	const uint32_t *indices = reinterpret_cast<const uint32_t*>(base + layout.columns);
+	const double *boosts = reinterpret_cast<const double*>(base + layout.boosts);
+	const uint64_t *offsets = reinterpret_cast<const uint64_t*>(base + layout.offsets);
+	const uint32_t *coordinates = reinterpret_cast<const uint32_t*>(base + layout.coordinates);
+	const uint8_t *types = reinterpret_cast<const uint8_t*>(base + layout.types);
+	const float *permanences = reinterpret_cast<const float*>(base + layout.permanences);
+	const uint16_t *qpermanences = reinterpret_cast<const uint16_t*>(base + layout.permanences);
+	const bool quantized = ( header.flags & REGION_FILE_QUANTIZED ) != 0;
+
+	// Initialize the region
+	if ( !delta ) {
+		init( header.height, header.width, header.cellsPerColumn );
+	}
+
+	// Initialize all the stored columns
+	for ( size_t c = 0; c < layout.numOfColumns; c++ ) {
+		const size_t index = ( delta )? indices[c] : c;
+		if ( index >= this->height * this->width ) {
+			continue;
+		}
+		Column &column = this->columns[index / this->width][index % this->width];
+		auto *synapses = column.getSynapses();
+		const size_t first = offsets[c];
+		const size_t last = offsets[c + 1];
+
+		column.setBoost( boosts[c] );
+		synapses->clear();
+		synapses->reserve( last - first );
+		for ( size_t n = first; n < last; n++ ) {
+			const float permanence = ( quantized )?
+				static_cast<float>(qpermanences[n] / REGION_FILE_QUANTIZATION_SCALE) : permanences[n];
+
+			if ( types[n] == 'e' ) {
+				Synapse synapse(coordinates[3 * n], coordinates[3 * n + 1], coordinates[3 * n + 2],
+					this->getDataSource(), SynapseType::EXCITATORY);
+				synapse.setPermanence(permanence);
+				synapses->push_back(synapse);
+			} else if ( types[n] == 'i' ) {
+				Synapse synapse(coordinates[3 * n], coordinates[3 * n + 1], coordinates[3 * n + 2],
+					nullptr, SynapseType::INHIBITORY);
+				synapse.setPermanence(permanence);
+				synapses->push_back(synapse);
+			}
+		}
+	}
+}
+
+// Map region from binary file, the synapse arrays are used in place
+void Region::loadMapped( std::string fileName ) {
+	shared_ptr<RegionFileMapping> mapping = make_shared<RegionFileMapping>( fileName );
+
+	if ( !mapping->isOpen() ) {
+		cout << "Failure: unable to open a file to load the region" << endl;
+		return;
+	}
+	if ( !mapping->isValid() || ( mapping->getHeader().flags & (REGION_FILE_DELTA | REGION_FILE_COMPRESSED) ) ) {
+		cout << "Failure: unsupported region file format" << endl;
+		return;
+	}
+
+	// The checksum is not verified here, since it would read the whole file,
+	// but the synapses were validated, so they are read without checks
+	const RegionFileHeader &header = mapping->getHeader();
+	RegionFileLayout layout( header );
+	const char *base = mapping->getData();
+	const double *boosts = reinterpret_cast<const double*>(base + layout.boosts);
+	const uint64_t *offsets = reinterpret_cast<const uint64_t*>(base + layout.offsets);
+	const bool quantized = ( header.flags & REGION_FILE_QUANTIZED ) != 0;
+
+	// Initialize the region
+	init( header.height, header.width, header.cellsPerColumn );
+	this->mapping = mapping;
+
+	// Point all the columns to their synapses in the mapped file
+	for ( size_t i = 0; i < this->height; i++ ) {
+		for ( size_t j = 0; j < this->width; j++ ) {
+			const size_t first = offsets[i * this->width + j];
+			SynapseArrays arrays;
+
+			arrays.coordinates = reinterpret_cast<const uint32_t*>(base + layout.coordinates) + 3 * first;
+			arrays.types = reinterpret_cast<const uint8_t*>(base + layout.types) + first;
+			arrays.permanences = ( quantized )? nullptr : reinterpret_cast<const float*>(base + layout.permanences) + first;
+			arrays.qpermanences = ( quantized )? reinterpret_cast<const uint16_t*>(base + layout.permanences) + first : nullptr;
+			arrays.size = offsets[i * this->width + j + 1] - first;
+			arrays.dataSource = this->dataSource;
+
+			this->columns[i][j].setBoost( boosts[i * this->width + j] );
+			this->columns[i][j].getProximalDendrite().setMappedSynapses( arrays );
+		}
+	}
+}
+
+// Load region from text file
+void Region::loadText( std::string fileName ) {
 	ifstream myfile(fileName.c_str());
 
 	if ( myfile.is_open() ) {
@@ -131,6 +448,158 @@ double Region::getValue( size_t i, size_t j, size_t k ) const {
 	return (this->columns[i][j][k].getState(CellState::ACTIVE_STATE, 1))? 1.0 : 0.0;
 }
 
+namespace {
+
+// Channels of a window of the input copied one after another, read by the
+// overlap loop without a call per synapse
+struct InputWindow {
+	const double *values;
+	Rect window;
+
+	inline double at( size_t i, size_t j, size_t k ) const {
+		return this->values[(k * this->window.height + i - this->window.y) * this->window.width + j - this->window.x];
+	}
+};
+
+// Window of the input for receptive fields not fully inside it,
+// the values outside the window are read from the data source
+struct ClippedInputWindow {
+	InputWindow input;
+	const DataSource *source;
+
+	inline double at( size_t i, size_t j, size_t k ) const {
+		const Rect &window = this->input.window;
+		if ( static_cast<int>(i) < window.y || static_cast<int>(j) < window.x ||
+		     static_cast<int>(i) >= window.y + window.height || static_cast<int>(j) >= window.x + window.width ) {
+			return this->source->getValue( i, j, k );
+		}
+		return this->input.at( i, j, k );
+	}
+};
+
+}
+
+/* Calculate the overlap of every column with the current input. The columns
+   are grouped by the input tile holding the top left corner of their receptive
+   field. The tiles are then visited in the row-major order and the window
+   covering the receptive fields of a tile is read from the data source only
+   once. The window is clipped to the tile and its eight neighbours, and the few
+   synapses outside of it are read from the data source one by one, so the input
+   traffic stays proportional to the input size instead of to the number of
+   columns times the receptive field size. Without tiling the input is read as
+   a single tile. The window is copied by the data source, one call per channel,
+   and the overlap loop reads the copy directly.
+   An integral image of the absolute values of the window is built from the copy,
+   and the columns whose connected receptive field bounding box sums to zero, or
+   to less than the threshold, are skipped with the overlap set to zero. The sum
+   bounds the absolute value of the overlap from above, whatever the sign of the
+   input, as long as no two synapses of a column share the same input position. */
+size_t Region::calculateOverlap( size_t tileSize, double threshold ) {
+	const size_t inputHeight = this->dataSource->getHeight();
+	const size_t inputWidth = this->dataSource->getWidth();
+	size_t skipped = 0;
+
+	if ( tileSize == 0 ) {
+		tileSize = std::max<size_t>( std::max( inputHeight, inputWidth ), 1 );
+	}
+	const size_t tileRows = (inputHeight + tileSize - 1) / tileSize;
+	const size_t tileCols = (inputWidth + tileSize - 1) / tileSize;
+	vector<vector<size_t>> members( tileRows * tileCols );
+	vector<Rect> windows( tileRows * tileCols );
+
+	// Group the columns by the tiles, the columns without connected synapses are skipped
+	for ( size_t n = 0; n < this->height * this->width; n++ ) {
+		Column &column = this->columns[n / this->width][n % this->width];
+		const Rect &box = column.getRFBoundingBox( );
+
+		if ( box.empty() ) {
+			column.setOverlap( 0.0 );
+			skipped++;
+			continue;
+		}
+		const size_t ti = std::min( box.y / tileSize, tileRows - 1 );
+		const size_t tj = std::min( box.x / tileSize, tileCols - 1 );
+		const size_t t = ti * tileCols + tj;
+
+		if ( members[t].empty() ) {
+			windows[t] = box;
+		} else {
+			const int top = std::min( windows[t].y, box.y );
+			const int left = std::min( windows[t].x, box.x );
+			const int bottom = std::max( windows[t].y + windows[t].height, box.y + box.height );
+			const int right = std::max( windows[t].x + windows[t].width, box.x + box.width );
+			windows[t] = Rect( left, top, right - left, bottom - top );
+		}
+		members[t].push_back( n );
+	}
+
+	// Process every tile once for all of its columns
+	const int tileExtent = static_cast<int>(tileSize);
+	const Rect input( 0, 0, inputWidth, inputHeight );
+	for ( size_t t = 0; t < members.size(); t++ ) {
+		if ( members[t].empty() ) {
+			continue;
+		}
+		const Rect bounds( static_cast<int>(t % tileCols) * tileExtent - tileExtent,
+		                   static_cast<int>(t / tileCols) * tileExtent - tileExtent,
+		                   3 * tileExtent, 3 * tileExtent );
+		const Rect window = windows[t] & bounds & input;
+		const size_t planeSize = window.area();
+		size_t windowChannels = 0;
+
+		for ( size_t n : members[t] ) {
+			windowChannels = std::max( windowChannels, this->columns[n / this->width][n % this->width].getRFChannels( ) );
+		}
+		this->inputWindow.resize( planeSize * windowChannels );
+		for ( size_t k = 0; k < windowChannels; k++ ) {
+			this->dataSource->getWindow( window, k, this->inputWindow.data() + k * planeSize );
+		}
+
+		// Integral image of the window over all the channels read by its columns
+		this->inputIntegral.create( window.height + 1, window.width + 1, CV_64FC1 );
+		this->inputIntegral.row(0).setTo( Scalar(0) );
+		for ( int i = 0; i < window.height; i++ ) {
+			const double *prev = this->inputIntegral.ptr<double>(i);
+			double *row = this->inputIntegral.ptr<double>(i + 1);
+			double sum = 0.0;
+
+			row[0] = 0.0;
+			for ( int j = 0; j < window.width; j++ ) {
+				for ( size_t k = 0; k < windowChannels; k++ ) {
+					sum += std::fabs( this->inputWindow[k * planeSize + i * window.width + j] );
+				}
+				row[j + 1] = prev[j + 1] + sum;
+			}
+		}
+
+		const InputWindow values = { this->inputWindow.data(), window };
+		const ClippedInputWindow clipped = { values, this->dataSource };
+		for ( size_t n : members[t] ) {
+			Column &column = this->columns[n / this->width][n % this->width];
+			const Rect &box = column.getRFBoundingBox( );
+
+			if ( (box & window).area() != box.area() ) {
+				column.setOverlap( column.calculateInputOverlap( clipped ) );
+				continue;
+			}
+			// Skip the columns over blank input
+			const int top = box.y - window.y;
+			const int left = box.x - window.x;
+			const int bottom = top + box.height;
+			const int right = left + box.width;
+			const double sum = this->inputIntegral.at<double>(bottom, right) - this->inputIntegral.at<double>(top, right)
+			                 - this->inputIntegral.at<double>(bottom, left) + this->inputIntegral.at<double>(top, left);
+			if ( sum <= 0.0 || sum + 1e-9 < threshold ) {
+				column.setOverlap( 0.0 );
+				skipped++;
+				continue;
+			}
+			column.setOverlap( column.calculateInputOverlap( values ) );
+		}
+	}
+	return skipped;
+}
+
 // Calculate mean number of connected synapses for individual column
 double Region::calculateMeanConnectedSynapses( ) const {
 	double meanConnectedSynapses = 0.0;
@@ -145,52 +614,130 @@ double Region::calculateMeanConnectedSynapses( ) const {
     return meanConnectedSynapses;
 }
 
-// Visualize receptive fields
-Mat Region::visualize( bool showActiveColumns ) const {
-	const size_t sensoryInputHeight = this->dataSource->getHeight();
-	const size_t sensoryInputWidth = this->dataSource->getWidth();
-	Mat img = Mat::zeros(
-		this->height * sensoryInputHeight + this->height + 1,
-		this->width * sensoryInputWidth + this->width + 1,
+// Paint the background and the grid of an empty canvas
+void Region::resetCanvas( size_t tileHeight, size_t tileWidth ) const {
+	this->canvas.create(
+		this->height * tileHeight + this->height + 1,
+		this->width * tileWidth + this->width + 1,
 		CV_8UC3
 	);
 	// Set background
-	img.setTo(cv::Scalar(150, 150, 150));
+	this->canvas.setTo(cv::Scalar(150, 150, 150));
 	// Visualize grid
-	for ( size_t i = 0; i < img.rows; i += sensoryInputHeight + 1 ) {
-		for ( size_t j = 0; j < img.cols; j++ ) {
-			img.at<Vec3b>(i,j) = Vec3b(70, 70, 70);
-		}
+	for ( int i = 0; i < this->canvas.rows; i += tileHeight + 1 ) {
+		this->canvas.row(i).setTo(cv::Scalar(70, 70, 70));
+	}
+	for ( int j = 0; j < this->canvas.cols; j += tileWidth + 1 ) {
+		this->canvas.col(j).setTo(cv::Scalar(70, 70, 70));
 	}
-	for ( size_t i = 0; i < img.rows; i++ ) {
-		for ( size_t j = 0; j < img.cols; j += sensoryInputWidth + 1 ) {
-			img.at<Vec3b>(i,j) = Vec3b(70, 70, 70);
+	// Every tile has to be drawn on the next render
+	this->tileRevisions.assign(this->height * this->width, 0);
+	this->tileActive.assign(this->height * this->width, 0);
+}
+
+// Redraw the receptive field of a single column
+void Region::drawTile( size_t i, size_t j, size_t tileHeight, size_t tileWidth ) const {
+	const size_t di = i * tileHeight + (i + 1);
+	const size_t dj = j * tileWidth + (j + 1);
+
+	this->canvas( Rect( dj, di, tileWidth, tileHeight ) ).setTo(cv::Scalar(150, 150, 150));
+
+	this->columns[i][j].getProximalDendrite().forEachSynapse( [&]( const SynapseView &syn ) {
+		if ( syn.isExcitatory() && syn.isConnected() ) {
+			Vec3b *row = this->canvas.ptr<Vec3b>(di + syn.getI( ));
+			if ( syn.getK() == 0) {
+				row[dj + syn.getJ( )] = Vec3b(255, 255, 255);
+			} else {
+				row[dj + syn.getJ( )] = Vec3b(0, 0, 0);
+			}
 		}
+	} );
+}
+
+// Redraw the frame around a single column, which is shared with its neighbours
+void Region::drawTileBorder( size_t i, size_t j, size_t tileHeight, size_t tileWidth, bool active ) const {
+	const size_t di = i * tileHeight + (i + 1);
+	const size_t dj = j * tileWidth + (j + 1);
+
+	if ( active ) {
+		rectangle( this->canvas, Point( dj - 1, di - 1 ), Point( dj + tileWidth, di + tileHeight ),
+		           Scalar( 0, 0, 255 ), 1, 8 );
+	} else {
+		rectangle( this->canvas, Point( dj - 1, di - 1 ), Point( dj + tileWidth, di + tileHeight ),
+		           Scalar( 70, 70, 70 ), 1, 8 );
 	}
-	// Visualize receptive fields
+}
+
+// Visualize receptive fields
+Mat Region::visualize( bool showActiveColumns ) const {
+	const size_t sensoryInputHeight = this->dataSource->getHeight();
+	const size_t sensoryInputWidth = this->dataSource->getWidth();
+	const int rows = this->height * sensoryInputHeight + this->height + 1;
+	const int cols = this->width * sensoryInputWidth + this->width + 1;
+	bool redrawAll = false;
+
+	// The grid is painted only when the canvas is created
+	if ( this->canvas.rows != rows || this->canvas.cols != cols ) {
+		this->resetCanvas( sensoryInputHeight, sensoryInputWidth );
+		redrawAll = true;
+	}
+
+	// Redraw only the columns whose synapses could have been modified
+	// since the last render, or whose state has changed
+	vector<uchar> activeChanged(this->height * this->width, 0);
+	bool anyActiveChanged = false;
 	for ( size_t i = 0; i < height; i++ ) {
 		for ( size_t j = 0; j < width; j++ ) {
-			size_t di = i * sensoryInputHeight + (i + 1);
-			size_t dj = j * sensoryInputWidth + (j + 1);
+			const size_t n = i * this->width + j;
+			const uint64_t revision = this->columns[i][j].getProximalDendrite().getRevision( );
+			const uchar active = ( showActiveColumns && this->columns[i][j].isActive( ) )? 1 : 0;
 
-			if ( showActiveColumns && columns[i][j].isActive( ) ) {
-				rectangle( img, Point( dj - 1, di - 1 ), Point( dj + sensoryInputWidth, di + sensoryInputHeight ),
-				           Scalar( 0, 0, 255 ), 1, 8 );
+			if ( redrawAll || revision != this->tileRevisions[n] ) {
+				this->drawTile( i, j, sensoryInputHeight, sensoryInputWidth );
+				this->tileRevisions[n] = revision;
+			}
+			if ( active != this->tileActive[n] ) {
+				this->tileActive[n] = active;
+				activeChanged[n] = 1;
+				anyActiveChanged = true;
 			}
+		}
+	}
 
-			auto *synapses = this->columns[i][j].getSynapses();
-			for ( auto syn : (*synapses) ) {
-				if ( syn.isExcitatory() && syn.isConnected() ) {
-					if ( syn.getK() == 0) {
-						img.at<Vec3b>(di + syn.getI( ), dj + syn.getJ( )) = Vec3b(255, 255, 255);
-					} else {
-						img.at<Vec3b>(di + syn.getI( ), dj + syn.getJ( )) = Vec3b(0, 0, 0);
+	// Frames are shared by the neighbouring tiles, so the inactive ones are
+	// cleared first and the active ones around them are drawn again afterwards
+	if ( anyActiveChanged ) {
+		for ( size_t i = 0; i < height; i++ ) {
+			for ( size_t j = 0; j < width; j++ ) {
+				const size_t n = i * this->width + j;
+				if ( activeChanged[n] && !this->tileActive[n] ) {
+					this->drawTileBorder( i, j, sensoryInputHeight, sensoryInputWidth, false );
+				}
+			}
+		}
+		for ( size_t i = 0; i < height; i++ ) {
+			for ( size_t j = 0; j < width; j++ ) {
+				if ( !this->tileActive[i * this->width + j] ) {
+					continue;
+				}
+				// Check whether any neighbour (or the column itself) has changed
+				bool touched = false;
+				for ( size_t ni = (i > 0)? i - 1 : 0; ni <= i + 1 && ni < height && !touched; ni++ ) {
+					for ( size_t nj = (j > 0)? j - 1 : 0; nj <= j + 1 && nj < width; nj++ ) {
+						if ( activeChanged[ni * this->width + nj] ) {
+							touched = true;
+							break;
+						}
 					}
 				}
+				if ( touched ) {
+					this->drawTileBorder( i, j, sensoryInputHeight, sensoryInputWidth, true );
+				}
 			}
 		}
 	}
-	return img;
+	// The canvas is kept for the next call, the caller gets its own image
+	return this->canvas.clone();
 }
 
 // Decode input patch
@@ -205,7 +752,7 @@ Mat Region::decode( Mat activeColumns ) const {
 			uchar r = activeColumns.at<uchar>(1,z) & (0x01 << bit);
 
 			if ( r != 0 ) {
-				Mat rf = this->columns[i][j].getReceptiveField( );
+				Mat rf = this->columns[i][j].getReceptiveField( sensoryInputHeight, sensoryInputWidth );
 				res += rf;
 			}
 		}
@@ -221,7 +768,7 @@ Mat Region::decode( bitvector activeColumns ) const {
 	for ( size_t i = 0; i < this->height; i++ ) {
 		for ( size_t j = 0; j < this->width; j++ ) {
 			if ( activeColumns.at( i * this->width + j ) ) {
-				Mat rf = this->columns[i][j].getReceptiveField( );
+				Mat rf = this->columns[i][j].getReceptiveField( sensoryInputHeight, sensoryInputWidth );
 				res += rf;
 			}
 		}
@@ -239,13 +786,12 @@ void Region::printStatistics() const {
 
 	for ( size_t i = 0; i < this->height; i++ ) {
 		for ( size_t j = 0; j < this->width; j++ ) {
-			auto *synapses = this->columns[i][j].getSynapses( );
 			double sumCPerm[2] = {0.0, 0.0};
 			double sumDPerm[2] = {0.0, 0.0};
 			int numCSyn[2] = {0, 0};
 			int numDSyn[2] = {0, 0};
 
-			for ( auto syn : (*synapses) ) {
+			this->columns[i][j].getProximalDendrite().forEachSynapse( [&]( const SynapseView &syn ) {
 				size_t k = ( syn.isExcitatory() )? 0 : 1;
 				if ( syn.isConnected() ) {
 					numCSyn[k]++;
@@ -254,7 +800,7 @@ void Region::printStatistics() const {
 					numDSyn[k]++;
 					sumDPerm[k] += syn.getPermanence();
 				}
-			}
+			} );
 
 			for ( size_t k = 0; k < 2; k++ ) {
 				totalCSyn[k] += numCSyn[k];
@@ -289,17 +835,15 @@ void Region::printStatistics() const {
 	cout << "- Num. of columns with connected synapses\t" << static_cast<int>(statistics[4][0]) << "/" << static_cast<int>(statistics[4][1]) << endl;
 }
 
+// Clone region. The columns are copied with their cells and state, but the
+// synapses are shared and each column copies them only when it modifies them.
 void Region::clone( Region *region ) const {
 	region->init( this->height, this->width, this->cellsPerColumn );
-	region->setDataSource( this->dataSource );
+	region->dataSource = this->dataSource;
+	region->mapping = this->mapping;
 	for ( size_t i = 0; i < this->height; i++ ) {
 		for ( size_t j = 0; j < this->width; j++ ) {
-			auto *synapses = columns[i][j].getSynapses();
-			for ( auto syn : (*synapses) ) {
-				Synapse synapse(syn.getI(), syn.getJ(), 0, this->dataSource, syn.getType());
-				synapse.setPermanence( syn.getPermanence() );
-				(*region)[i][j].addSynapse( synapse );
-			}
+			region->columns[i][j] = this->columns[i][j];
 		}
 	}
 }
@@ -1,11 +1,14 @@
 #ifndef REGION_HPP_
 #define REGION_HPP_
 
+#include <future>
+#include <memory>
 #include <opencv2/opencv.hpp>
 
 #include "common/types.hpp"
 #include "htmcla/column.hpp"
 #include "htmcla/htmcla.hpp"
+#include "htmcla/regionfile.hpp"
 #include "htmcla/synapse.hpp"
 
 using namespace std;
@@ -18,16 +21,50 @@ class Region : public DataSource {
 		size_t cellsPerColumn;
 		// Data source
 		DataSource *dataSource;
+		// Region file the columns are mapped from (mapped regions only)
+		shared_ptr<RegionFileMapping> mapping;
+		// Visualization canvas kept between the calls of visualize(), with the
+		// proximal segment revision and active flag of every drawn tile
+		mutable Mat canvas;
+		mutable vector<uint64_t> tileRevisions;
+		mutable vector<uchar> tileActive;
+		// Copy of the input window whose columns are being processed and
+		// integral image of its absolute values summed over its channels
+		vector<double> inputWindow;
+		Mat inputIntegral;
+
+		// Save/load helpers
+		void saveText( std::string fileName );
+		void saveBinary( std::string fileName, bool quantize, const vector<uint32_t> *columns, uint64_t generation );
+		void serializeBinary( bool quantize, const vector<uint32_t> *columns, RegionFileHeader &header, vector<char> &payload );
+		void loadText( std::string fileName );
+		void loadBinary( std::string fileName );
+		void loadMapped( std::string fileName );
+		// Visualization helpers
+		void resetCanvas( size_t tileHeight, size_t tileWidth ) const;
+		void drawTile( size_t i, size_t j, size_t tileHeight, size_t tileWidth ) const;
+		void drawTileBorder( size_t i, size_t j, size_t tileHeight, size_t tileWidth, bool active ) const;
+		// Free the column grid
+		void releaseColumns( );
 
 	public:
 		Region( ) = delete;
+		// The column grid is owned by the region, use clone() to copy it
+		Region( const Region& ) = delete;
+		Region& operator=( const Region& ) = delete;
 		// Initialize region
 		Region( size_t height, size_t width, size_t cellsPerColumn = 1 );
+		~Region( );
 		void init( size_t height, size_t width, size_t cellsPerColumn );
 		void setDataSource( DataSource *src, double alpha = 0.0 );
-		// Save/load region to/from file
-		void save( std::string fileName );
-		void load( std::string fileName );
+		// Save/load region to/from file, binary files record the checkpoint generation
+		void save( std::string fileName, RegionFileFormat format = RegionFileFormat::BINARY, uint64_t generation = 0 );
+		void load( std::string fileName, RegionLoadMode mode = RegionLoadMode::COPY );
+		void saveDelta( std::string fileName, const vector<uint32_t> &columns,
+		                RegionFileFormat format = RegionFileFormat::BINARY, uint64_t generation = 0 );
+		// Save as binary file on a background thread, the future does not block when destroyed
+		future<bool> saveAsync( std::string fileName, RegionFileFormat format = RegionFileFormat::BINARY,
+		                        bool compress = true );
 		// Getters
 		inline Column** getColumns( ) const {
 			return this->columns;
@@ -38,11 +75,18 @@ class Region : public DataSource {
 		inline size_t getCellsPerColumn( ) const {
 			return this->cellsPerColumn;
 		}
+		inline bool isMapped( ) const {
+			return this->mapping != nullptr;
+		}
 		double getValue( size_t i, size_t j, size_t k = 0 ) const override;
 		// Get access to the column grid
 		Column* operator [ ]( const size_t i ) const {
 			return this->columns[i];
 		}
+		// Calculate the overlap of every column with the current input, optionally
+		// tile by tile for inputs too large to be accessed at random, returns
+		// the number of columns skipped as their overlap is zero or below threshold
+		size_t calculateOverlap( size_t tileSize = 0, double threshold = 0.0 );
 		// Calculate mean number of connected synapses
 		double calculateMeanConnectedSynapses( ) const;
 		// Visualize the receptive fields
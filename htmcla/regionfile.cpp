@@ -0,0 +1,176 @@
+#include "regionfile.hpp"
+
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+RegionFileMapping::RegionFileMapping( std::string fileName ) {
+	this->data = nullptr;
+	this->size = 0;
+
+	int fd = open( fileName.c_str(), O_RDONLY );
+	if ( fd < 0 ) {
+		return;
+	}
+
+	struct stat st;
+	if ( fstat( fd, &st ) == 0 && static_cast<size_t>(st.st_size) >= sizeof(RegionFileHeader) ) {
+		void *ptr = mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+		if ( ptr != MAP_FAILED ) {
+			this->data = ptr;
+			this->size = st.st_size;
+		}
+	}
+	// The mapping stays valid after the descriptor is closed
+	close( fd );
+}
+
+RegionFileMapping::~RegionFileMapping( ) {
+	if ( this->data != nullptr ) {
+		munmap( this->data, this->size );
+	}
+}
+
+bool RegionFileMapping::isValid( ) const {
+	if ( !this->isOpen() || !isRegionFileSizeValid( this->getHeader(), this->size ) ) {
+		return false;
+	}
+	return ( this->getHeader().flags & REGION_FILE_COMPRESSED ) ||
+	       ( areRegionFileOffsetsValid( this->getHeader(), this->getData() ) &&
+	         areRegionFileSynapsesValid( this->getHeader(), this->getData() ) );
+}
+
+// Upper bound of the deflate compression ratio
+static const size_t REGION_FILE_MAX_COMPRESSION = 1032;
+
+bool isRegionFileSizeValid( const RegionFileHeader &header, size_t fileSize ) {
+	if ( !isRegionFileHeader( header ) || header.version != REGION_FILE_VERSION ||
+	     fileSize < regionFileAlign( sizeof(RegionFileHeader) ) ) {
+		return false;
+	}
+	// Counts larger than the (inflated) file itself could overflow the section offsets
+	const bool compressed = ( header.flags & REGION_FILE_COMPRESSED ) != 0;
+	const size_t payloadSize = fileSize - regionFileAlign( sizeof(RegionFileHeader) );
+	const size_t maxPayloadSize = ( compressed )? payloadSize * REGION_FILE_MAX_COMPRESSION : payloadSize;
+	const size_t numOfColumns = ( header.flags & REGION_FILE_DELTA )?
+		header.numOfColumns : static_cast<size_t>(header.height) * header.width;
+	if ( header.numOfSynapses > maxPayloadSize || numOfColumns > maxPayloadSize ) {
+		return false;
+	}
+	RegionFileLayout layout( header );
+	return layout.end - layout.columns <= maxPayloadSize;
+}
+
+bool areRegionFileOffsetsValid( const RegionFileHeader &header, const char *data ) {
+	// The synapses of every column have to lie within the synapse arrays
+	RegionFileLayout layout( header );
+	const uint64_t *offsets = reinterpret_cast<const uint64_t*>(data + layout.offsets);
+	for ( size_t c = 0; c < layout.numOfColumns; c++ ) {
+		if ( offsets[c] > offsets[c + 1] ) {
+			return false;
+		}
+	}
+	return offsets[layout.numOfColumns] <= header.numOfSynapses;
+}
+
+bool areRegionFileSynapsesValid( const RegionFileHeader &header, const char *data ) {
+	// Checked once here, so the synapses are read without checks afterwards
+	RegionFileLayout layout( header );
+	const uint8_t *types = reinterpret_cast<const uint8_t*>(data + layout.types);
+	for ( size_t n = 0; n < header.numOfSynapses; n++ ) {
+		if ( types[n] != 'e' && types[n] != 'i' ) {
+			return false;
+		}
+	}
+	// Quantized permanences are always within the range
+	if ( header.flags & REGION_FILE_QUANTIZED ) {
+		return true;
+	}
+	const float *permanences = reinterpret_cast<const float*>(data + layout.permanences);
+	for ( size_t n = 0; n < header.numOfSynapses; n++ ) {
+		if ( !( permanences[n] >= 0.0f && permanences[n] <= 1.0f ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool readRegionFileHeader( std::string fileName, RegionFileHeader &header ) {
+	int fd = open( fileName.c_str(), O_RDONLY );
+	if ( fd < 0 ) {
+		return false;
+	}
+	const bool ok = read( fd, &header, sizeof(header) ) == static_cast<ssize_t>(sizeof(header));
+	close( fd );
+	return ok && isRegionFileHeader( header ) && header.version == REGION_FILE_VERSION;
+}
+
+// Write the whole buffer, retrying on partial writes
+static bool writeAll( int fd, const char *data, size_t size ) {
+	while ( size > 0 ) {
+		ssize_t n = write( fd, data, size );
+		if ( n <= 0 ) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool writeRegionFile( std::string fileName, RegionFileHeader header, const std::vector<char> &payload,
+                      bool compress, bool sync ) {
+	std::vector<char> compressed;
+	const char *data = payload.data();
+	size_t size = payload.size();
+
+	header.checksum = crc32( 0L, reinterpret_cast<const Bytef*>(payload.data()), payload.size() );
+	if ( compress ) {
+		uLongf compressedSize = compressBound( payload.size() );
+		compressed.resize( compressedSize );
+		if ( compress2( reinterpret_cast<Bytef*>(compressed.data()), &compressedSize,
+		                reinterpret_cast<const Bytef*>(payload.data()), payload.size(), Z_BEST_SPEED ) != Z_OK ) {
+			return false;
+		}
+		header.flags |= REGION_FILE_COMPRESSED;
+		data = compressed.data();
+		size = compressedSize;
+	}
+
+	// The file is written under a unique name in the same directory and renamed
+	// over the target once it is complete and on the disk, so the readers and
+	// an interrupted write see either the whole old file or the whole new one
+	std::string tmpFileName = fileName + ".XXXXXX";
+	int fd = mkstemp( &tmpFileName[0] );
+	if ( fd < 0 ) {
+		return false;
+	}
+	// The payload starts right after the header (see RegionFileLayout)
+	std::vector<char> padding( regionFileAlign( sizeof(header) ) - sizeof(header), 0 );
+	bool ok = fchmod( fd, 0644 ) == 0 &&
+	          writeAll( fd, reinterpret_cast<const char*>(&header), sizeof(header) ) &&
+	          writeAll( fd, padding.data(), padding.size() ) &&
+	          writeAll( fd, data, size ) &&
+	          fsync( fd ) == 0;
+	ok = close( fd ) == 0 && ok;
+	if ( !ok || rename( tmpFileName.c_str(), fileName.c_str() ) != 0 ) {
+		unlink( tmpFileName.c_str() );
+		return false;
+	}
+
+	// The rename itself is durable once the directory is synced
+	if ( sync ) {
+		const size_t slash = fileName.rfind( '/' );
+		const std::string directory = ( slash == std::string::npos )? "." : fileName.substr( 0, ( slash > 0 )? slash : 1 );
+		int dirFd = open( directory.c_str(), O_RDONLY | O_DIRECTORY );
+		if ( dirFd < 0 ) {
+			return false;
+		}
+		ok = fsync( dirFd ) == 0;
+		ok = close( dirFd ) == 0 && ok;
+	}
+	return ok;
+}
@@ -0,0 +1,128 @@
+#ifndef REGIONFILE_HPP_
+#define REGIONFILE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* Binary region file layout (native byte order):
+   - RegionFileHeader
+   - indices of the stored columns (uint32_t[numOfColumns], delta files only)
+   - boost of every stored column (double[numOfColumns])
+   - synapse offsets of every stored column (uint64_t[numOfColumns + 1])
+   - synapse coordinates (uint32_t[3 * numOfSynapses], i.e. i, j, k triples)
+   - synapse types (uint8_t[numOfSynapses], 'e' or 'i')
+   - synapse permanences (float[numOfSynapses] or uint16_t[numOfSynapses] when quantized)
+   Every section starts at a multiple of 8 bytes, so the arrays can be used
+   directly from a memory mapped file. The checksum is the CRC32 of everything
+   after the header, padding included. A full file stores all height * width
+   columns in the row-major order, a delta file only the listed ones, which
+   replace the columns of the region it is applied to. In a compressed file
+   everything after the header is a single zlib stream (it cannot be mapped). */
+
+const char REGION_FILE_MAGIC[4] = { 'H', 'T', 'M', 'R' };
+const uint32_t REGION_FILE_VERSION = 2;
+const uint32_t REGION_FILE_QUANTIZED = 0x01;
+const uint32_t REGION_FILE_DELTA = 0x02;
+const uint32_t REGION_FILE_COMPRESSED = 0x04;
+const double REGION_FILE_QUANTIZATION_SCALE = 65535.0;
+
+struct RegionFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t height;
+	uint32_t width;
+	uint32_t cellsPerColumn;
+	uint64_t numOfSynapses;
+	uint32_t checksum;
+	// Number of stored columns in a delta file, unused otherwise
+	uint32_t numOfColumns;
+	// Checkpoint generation of a snapshot and of its deltas (see RegionCheckpoint)
+	uint64_t generation;
+};
+
+// Size of a section padded to the 8 byte boundary
+inline size_t regionFileAlign( size_t size ) {
+	return (size + 7) & ~static_cast<size_t>(7);
+}
+
+// Check whether the header starts with the binary region magic
+inline bool isRegionFileHeader( const RegionFileHeader &header ) {
+	return memcmp( header.magic, REGION_FILE_MAGIC, sizeof(REGION_FILE_MAGIC) ) == 0;
+}
+
+// Offsets of the individual sections from the beginning of the file
+struct RegionFileLayout {
+	size_t numOfColumns;
+	size_t columns, boosts, offsets, coordinates, types, permanences, end;
+
+	RegionFileLayout( const RegionFileHeader &header ) {
+		const bool delta = ( header.flags & REGION_FILE_DELTA ) != 0;
+		const size_t numOfSynapses = header.numOfSynapses;
+		const size_t permSize = ( header.flags & REGION_FILE_QUANTIZED )? sizeof(uint16_t) : sizeof(float);
+
+		numOfColumns = ( delta )? header.numOfColumns : static_cast<size_t>(header.height) * header.width;
+		columns = regionFileAlign( sizeof(RegionFileHeader) );
+		boosts = columns + ( ( delta )? regionFileAlign( numOfColumns * sizeof(uint32_t) ) : 0 );
+		offsets = boosts + regionFileAlign( numOfColumns * sizeof(double) );
+		coordinates = offsets + regionFileAlign( (numOfColumns + 1) * sizeof(uint64_t) );
+		types = coordinates + regionFileAlign( 3 * numOfSynapses * sizeof(uint32_t) );
+		permanences = types + regionFileAlign( numOfSynapses * sizeof(uint8_t) );
+		end = permanences + regionFileAlign( numOfSynapses * permSize );
+	}
+};
+
+// Read-only memory mapping of a binary region file. The pages are shared
+// through the page cache by all the processes mapping the same file.
+class RegionFileMapping {
+	private:
+		void *data;
+		size_t size;
+
+	public:
+		RegionFileMapping( const RegionFileMapping& ) = delete;
+		RegionFileMapping& operator=( const RegionFileMapping& ) = delete;
+		// Map the whole file, isOpen() tells whether it succeeded
+		RegionFileMapping( std::string fileName );
+		~RegionFileMapping( );
+		inline bool isOpen( ) const {
+			return this->data != nullptr;
+		}
+		inline size_t getSize( ) const {
+			return this->size;
+		}
+		inline const char* getData( ) const {
+			return static_cast<const char*>(this->data);
+		}
+		inline const RegionFileHeader& getHeader( ) const {
+			return *reinterpret_cast<const RegionFileHeader*>(this->data);
+		}
+		// Check magic, version, that all the sections fit into the file and,
+		// unless compressed, that the synapse offsets of the columns are
+		// in order and within the synapse arrays, and the synapses are valid
+		bool isValid( ) const;
+};
+
+// Check magic, version, and that all the sections fit into a file of the given
+// size (for a compressed file, that the payload could inflate from it)
+bool isRegionFileSizeValid( const RegionFileHeader &header, size_t fileSize );
+// Check that the synapse offsets of the columns, in the uncompressed file
+// starting at data, are in order and within the synapse arrays
+bool areRegionFileOffsetsValid( const RegionFileHeader &header, const char *data );
+// Check that the synapse types are known and the permanences within [0, 1]
+bool areRegionFileSynapsesValid( const RegionFileHeader &header, const char *data );
+
+// Read the header of a binary region file, returns false if the file is not one
+bool readRegionFileHeader( std::string fileName, RegionFileHeader &header );
+
+// Write the header (its checksum is computed here) and the payload of a region
+// file at once, optionally compressed. The file replaces the previous one only
+// when it has been written completely, and with sync the replacement is
+// on the disk before returning.
+bool writeRegionFile( std::string fileName, RegionFileHeader header, const std::vector<char> &payload,
+                      bool compress, bool sync );
+
+#endif /* REGIONFILE_HPP_ */
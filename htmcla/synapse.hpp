@@ -79,6 +79,59 @@ class Synapse {
 		inline double getInputValue( ) const {
 			return this->dataSource->getValue(this->i,this->j, this->k);
 		}
+		inline DataSource* getDataSource( ) const {
+			return this->dataSource;
+		}
+};
+
+// Read-only synapse visited by DendriteSegment::forEachSynapse, taken from
+// a Synapse or from the arrays of a mapped region file without any check
+class SynapseView {
+	private:
+		SynapseType type;
+		size_t i, j, k;
+		float permanence;
+		DataSource *dataSource;
+
+	public:
+		SynapseView( size_t i, size_t j, size_t k, float permanence, DataSource *dataSource, SynapseType type )
+			: type(type), i(i), j(j), k(k), permanence(permanence), dataSource(dataSource) {
+		}
+		SynapseView( const Synapse &syn )
+			: type(syn.getType()), i(syn.getI()), j(syn.getJ()), k(syn.getK()),
+			  permanence(syn.getPermanence()), dataSource(syn.getDataSource()) {
+		}
+		// Getters
+		inline size_t getI( ) const {
+			return this->i;
+		}
+		inline size_t getJ( ) const {
+			return this->j;
+		}
+		inline size_t getK( ) const {
+			return this->k;
+		}
+		inline float getPermanence( ) const {
+			return this->permanence;
+		}
+		inline SynapseType getType( ) const {
+			return this->type;
+		}
+		inline DataSource* getDataSource( ) const {
+			return this->dataSource;
+		}
+		inline bool isExcitatory( ) const {
+			return (this->type == SynapseType::EXCITATORY);
+		}
+		inline bool isInhibitory( ) const {
+			return (this->type == SynapseType::INHIBITORY);
+		}
+		inline bool isConnected( ) const {
+			return (this->permanence >= connectThreshold);
+		}
+		inline double getInputValue( ) const {
+			return this->dataSource->getValue(this->i,this->j, this->k);
+		}
 };
 
 #endif /* SYNAPSE_HPP_ */
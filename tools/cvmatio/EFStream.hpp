@@ -40,6 +40,14 @@
 
 #include <fstream>
 #include <algorithm>
+#include <cstring>
+#include <stdint.h>
+// the SSSE3 path is compiled for x86 by GCC and Clang whatever the
+// target flags, and only taken when the processor supports it
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define EFSTREAM_SSSE3
+#include <tmmintrin.h>
+#endif
 
 /*! @class EFStream
  *  @brief Endian-swap File Stream
@@ -59,18 +67,86 @@ public:
     bool byteSwap(void) { return byte_swap_; }
     void setByteSwap(bool state) { byte_swap_ = state; }
 
-    // method to swap the Endianness of a stream
-    void swapEndian(char *s, std::streamsize N) {
-        for (unsigned int n = 0; n < N; n+=2) std::swap(s[n], s[n+1]);
+#ifdef EFSTREAM_SSSE3
+    /*! @brief Reverse the bytes of the elements of the first 16 byte blocks
+     * @return the number of bytes reversed
+     */
+    __attribute__((target("ssse3")))
+    static std::streamsize swapEndianSSSE3(char *s, std::streamsize N, int width) {
+        const __m128i mask = width == 2 ? _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14) :
+                             width == 4 ? _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12) :
+                                          _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        std::streamsize n = 0;
+        for (; n + 16 <= N; n += 16) {
+            __m128i *p = reinterpret_cast<__m128i *>(s + n);
+            _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
+        }
+        return n;
     }
 
-    // overloaded fstream read method with 
-    // byte swapping capacity
-    std::istream& read(char *s, std::streamsize n) {
+    // whether the processor supports SSSE3, checked once
+    static bool hasSSSE3() {
+#ifdef __SSSE3__
+        return true;
+#else
+        static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("ssse3"));
+        return supported;
+#endif
+    }
+#endif
+
+    /*! @brief Reverse the bytes of every element of an array in place
+     *
+     * 16 bytes are shuffled at a time when the processor supports SSSE3,
+     * the remainder (or everything, otherwise) one element at a time.
+     * @param s the array
+     * @param N the number of bytes, a multiple of width
+     * @param width the element width (2, 4 or 8 bytes, anything else is left as is)
+     */
+    static void swapEndian(char *s, std::streamsize N, int width = 2) {
+        std::streamsize n = 0;
+#ifdef EFSTREAM_SSSE3
+        if ((width == 2 || width == 4 || width == 8) && hasSSSE3()) n = swapEndianSSSE3(s, N, width);
+#endif
+        switch (width) {
+            case 2:
+                for (; n + 2 <= N; n += 2) {
+                    uint16_t v;
+                    memcpy(&v, s + n, 2);
+                    v = __builtin_bswap16(v);
+                    memcpy(s + n, &v, 2);
+                }
+                break;
+            case 4:
+                for (; n + 4 <= N; n += 4) {
+                    uint32_t v;
+                    memcpy(&v, s + n, 4);
+                    v = __builtin_bswap32(v);
+                    memcpy(s + n, &v, 4);
+                }
+                break;
+            case 8:
+                for (; n + 8 <= N; n += 8) {
+                    uint64_t v;
+                    memcpy(&v, s + n, 8);
+                    v = __builtin_bswap64(v);
+                    memcpy(s + n, &v, 8);
+                }
+                break;
+            default: break;
+        }
+    }
+
+    // the plain fstream read returns the raw bytes
+    using std::fstream::read;
+
+    // read an array of elements of the given width, reversing
+    // the bytes of each element if the stream needs byte swapping
+    std::istream& read(char *s, std::streamsize n, int width) {
         // call the parent read
         std::istream& stream = std::fstream::read(s,n);
         // swap the endianness if necessary
-        if (byte_swap_ && n%2 == 0) swapEndian(s,n);
+        if (byte_swap_ && width > 1) swapEndian(s, gcount() - gcount() % width, width);
         return stream;
     }
 };
@@ -41,22 +41,109 @@
 #include <zlib.h>
 #include <iostream>
 #include <exception>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <ctime>
 #include "MatlabIO.hpp"
 using namespace std;
 using namespace cv;
 
+#if CV_VERSION_MAJOR >= 4
+typedef AccessFlag MatAccessFlag;
+#else
+typedef int MatAccessFlag;
+#endif
+
+struct MatlabIOMapping {
+    void *addr;
+    size_t size;
+    MatlabIOMapping(void *addr, size_t size) : addr(addr), size(size) {}
+    ~MatlabIOMapping() { munmap(addr, size); }
+};
+
+/*! @class MappedViewAllocator
+ *  @brief Releases the matrices viewing a mapped file
+ *
+ *  The data of a view is owned by its share of the mapping, so the mapping
+ *  outlives the file being closed until the last view is released. The views
+ *  never allocate, any other request is passed to the standard allocator.
+ */
+class MappedViewAllocator : public MatAllocator {
+public:
+    UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, MatAccessFlag flags, UMatUsageFlags usageFlags) const {
+        return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+    bool allocate(UMatData* data, MatAccessFlag accessflags, UMatUsageFlags usageFlags) const {
+        return Mat::getStdAllocator()->allocate(data, accessflags, usageFlags);
+    }
+    void deallocate(UMatData* u) const {
+        delete static_cast<shared_ptr<MatlabIOMapping> *>(u->userdata);
+        delete u;
+    }
+};
+
+/*! @brief make a matrix over mapped data share the ownership of the mapping
+ *
+ * @param view the matrix, which must not own its data
+ * @param mapping the mapping holding the data of the matrix
+ */
+static void shareMapping(Mat& view, const shared_ptr<MatlabIOMapping>& mapping) {
+    static MappedViewAllocator allocator;
+    UMatData *u = new UMatData(&allocator);
+    u->data = u->origdata = view.data;
+    u->size = view.total() * view.elemSize();
+    u->userdata = new shared_ptr<MatlabIOMapping>(mapping);
+    u->refcount = 1;
+    view.u = u;
+}
+
 /*! @brief Open a filestream for reading or writing
+ *
+ * In the "m" mode the file is also memory mapped and the variables are parsed
+ * in place. Uncompressed numeric arrays whose layout is the same in the column
+ * major and the row major order (vectors and scalars) are then returned as
+ * cv::Mat views over the mapping. The views keep the mapping alive after the
+ * file is closed, and as the mapping is private, writing into a view changes
+ * neither the file nor the other views read later.
  *
  * @param filename the full name and filepath of the file
- * @param mode either "r" for reading or "w" for writing
+ * @param mode either "r" for reading, "m" for mapped reading or "w" for writing
  * @return true if the file open succeeded, false otherwise
  */
 bool MatlabIO::open(string filename, string mode) {
 
-    // open the file
+    // open the file, forgetting the variables of the previous one
 	filename_ = filename;
-    if (mode.compare("r") == 0) fid_.open(filename.c_str(), fstream::in  | fstream::binary);
+	directory_.clear();
+    if (mode.compare("r") == 0 || mode.compare("m") == 0) fid_.open(filename.c_str(), fstream::in  | fstream::binary);
     if (mode.compare("w") == 0) fid_.open(filename.c_str(), fstream::out | fstream::binary);
+    if (mode.compare("m") == 0 && !fid_.fail()) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+            if (fd >= 0) ::close(fd);
+            fid_.close();
+            return false;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            fid_.close();
+            return false;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        mapping_ = make_shared<MatlabIOMapping>(map, st.st_size);
+        map_ = static_cast<const char *>(map);
+        map_size_ = st.st_size;
+        map_pos_ = 0;
+    }
     return !fid_.fail();
 }
 
@@ -69,6 +156,12 @@ bool MatlabIO::open(string filename, string mode) {
 bool MatlabIO::close(void) {
 
     // close the file and release any associated objects
+    if (map_ != NULL) {
+        mapping_.reset();
+        map_ = NULL;
+        map_size_ = 0;
+    }
+    directory_.clear();
     fid_.close();
     return !fid_.fail();
 }
@@ -88,49 +181,118 @@ T product(const vector<T>& vec) {
 	return acc;
 }
 
-/*! @brief transpose a multi-channel matrix
+/*! @brief size of an element of a storage type
+ *
+ * @param stor_type the storage type
+ * @return the size in bytes, 0 for non-numeric types
+ */
+static size_t storageSize(uint32_t stor_type) {
+	switch (stor_type) {
+		case MAT_INT8:   case MAT_UINT8:  case MAT_UTF8: return 1;
+		case MAT_INT16:  case MAT_UINT16: return 2;
+		case MAT_INT32:  case MAT_UINT32: case MAT_FLOAT: return 4;
+		case MAT_INT64:  case MAT_UINT64: case MAT_DOUBLE: return 8;
+		default: return 0;
+	}
+}
+
+/*! @brief convert the data elements of a byte swapped file to the native order
  *
- * The OpenCV builtin transpose method cannot tranpose multi-dimensional
- * matrices. This function provides that capability by splitting the matrix
- * into a vector of its channels, tranposing each channel, then merging
- * the result back into a single multi-channel matrix
+ * Walks a sequence of data elements, reversing the bytes of each tag and of
+ * each data array as a whole by its element width, and recursing into
+ * matrices (which also covers the fields of cells and structs). Compressed
+ * data is left as is, it is swapped once inflated. A truncated sequence is
+ * swapped as far as it goes, so a header can be swapped on its own.
  *
- * @param src the input matrix
- * @param dst the output matrix, where dst(i,j,k) == src(j,i,k)
+ * @param data the elements
+ * @param nbytes the number of bytes of the elements
  */
-void transposeMat(const Mat& src, Mat& dst) {
-	if (src.channels() > 1) {
-		vector<Mat> vec;
-		split(src, vec);
-		for (unsigned int n = 0; n < vec.size(); ++n) {
-			transpose(vec[n], vec[n]);
+static void swapElements(char *data, uint64_t nbytes) {
+	uint64_t pos = 0;
+	while (pos + 4 <= nbytes) {
+		// the first word of the tag tells whether it is in the small format
+		EFStream::swapEndian(data + pos, 4, 4);
+		uint32_t data_type;
+		memcpy(&data_type, data + pos, 4);
+		uint32_t dbytes;
+		uint64_t start;
+		if ((data_type >> 16) != 0) {
+			dbytes = min<uint32_t>(data_type >> 16, 4);
+			data_type &= 0xFFFF;
+			start = pos + 4;
+		} else {
+			if (pos + 8 > nbytes) return;
+			EFStream::swapEndian(data + pos + 4, 4, 4);
+			memcpy(&dbytes, data + pos + 4, 4);
+			start = pos + 8;
+		}
+		const uint64_t available = min<uint64_t>(dbytes, nbytes - start);
+		const int width = data_type == MAT_UTF16 ? 2 : data_type == MAT_UTF32 ? 4 : storageSize(data_type);
+		if (data_type == MAT_MATRIX) {
+			swapElements(data + start, available);
+		} else if (width > 1) {
+			EFStream::swapEndian(data + start, available - available % width, width);
 		}
-		merge(vec, dst);
-	} else {
-		transpose(src, dst);
+		if (start == pos + 4) pos += 8;
+		else if (data_type == MAT_COMPRESSED) pos = start + dbytes;
+		else pos = start + ((dbytes + 7) & ~static_cast<uint64_t>(7));
 	}
 }
 
-/*! @brief convert the type of a variable
+/*! @brief convert and transpose a block of columns into a matrix
  *
- * Given a vector of type char, interpret the data as an
- * vector of type T1, and convert it to a vector of type
- * T2.
- * @param in the input char vector
- * @return the same data, reinterpreted as type T2 through
- * storage type T1
+ * Reads ncols column major columns of dst.rows elements of type T1 and
+ * writes them converted to T2 into one channel of the columns
+ * [col0, col0+ncols) of the row major dst. The copy goes by square
+ * tiles so that both the reads and the writes stay in cache.
+ *
+ * @param src the column major input
+ * @param dst the output matrix of type T2
+ * @param col0 the first output column
+ * @param ncols the number of columns
+ * @param channel the output channel
  */
 template<class T1, class T2>
-vector<T2> convertPrimitiveType(const vector<char>& in) {
-
-	// firstly reinterpret the input as type T1
-	const unsigned int T1_size = in.size() / sizeof(T1);
-	const T1* in_ptr = reinterpret_cast<const T1*>(&(in[0]));
-
-	// construct the new vector
-	vector<T2> out(in_ptr, in_ptr+T1_size);
-	return out;
+void transposeConvert(const char *src, Mat& dst, int col0, int ncols, int channel) {
+	const T1 *in = reinterpret_cast<const T1 *>(src);
+	const int rows = dst.rows;
+	const int cn = dst.channels();
+	const int tile = 32;
+	for (int cb = 0; cb < ncols; cb += tile) {
+		const int ce = min(cb + tile, ncols);
+		for (int rb = 0; rb < rows; rb += tile) {
+			const int re = min(rb + tile, rows);
+			for (int r = rb; r < re; ++r) {
+				T2 *out = dst.ptr<T2>(r) + channel;
+				for (int c = cb; c < ce; ++c) out[(col0 + c) * cn] = static_cast<T2>(in[(size_t)c * rows + r]);
+			}
+		}
+	}
+}
 
+/*! @brief convert and transpose a block of columns of any storage type
+ *
+ * @param stor_type the storage type of the input
+ * @return false if the storage type is not numeric
+ * @see transposeConvert
+ */
+template<class T>
+bool transposeConvert(uint32_t stor_type, const char *src, Mat& dst, int col0, int ncols, int channel) {
+	switch (stor_type) {
+		case MAT_INT8:   transposeConvert<int8_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_UINT8:  transposeConvert<uint8_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_INT16:  transposeConvert<int16_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_UINT16: transposeConvert<uint16_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_INT32:  transposeConvert<int32_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_UINT32: transposeConvert<uint32_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_INT64:  transposeConvert<int64_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_UINT64: transposeConvert<uint64_t, T>(src, dst, col0, ncols, channel); break;
+		case MAT_FLOAT:  transposeConvert<float, T>(src, dst, col0, ncols, channel); break;
+		case MAT_DOUBLE: transposeConvert<double, T>(src, dst, col0, ncols, channel); break;
+		case MAT_UTF8:   transposeConvert<char, T>(src, dst, col0, ncols, channel); break;
+		default: return false;
+	}
+	return true;
 }
 
 /*! @brief get the .Mat file header information
@@ -152,15 +314,16 @@ void MatlabIO::getHeader(void) {
     fid_.read((char *)&version_, sizeof(int16_t));
     fid_.read(endian_, sizeof(char)*ENDIAN_LENGTH);
 
-    // get the actual version
-    if (version_ == 0x0100) version_ = VERSION_5;
-    if (version_ == 0x0200) version_ = VERSION_73;
-
     // get the endianess
     if (strcmp(endian_, "IM") == 0) byte_swap_ = false;
     if (strcmp(endian_, "MI") == 0) byte_swap_ = true;
     // turn on byte swapping if necessary
     fid_.setByteSwap(byte_swap_);
+    if (byte_swap_) EFStream::swapEndian((char *)&version_, sizeof(int16_t), sizeof(int16_t));
+
+    // get the actual version
+    if (version_ == 0x0100) version_ = VERSION_5;
+    if (version_ == 0x0200) version_ = VERSION_73;
 
     //printf("Header: %s\nSubsys: %s\nVersion: %d\nEndian: %s\nByte Swap: %d\n", header_, subsys_, version_, endian_, byte_swap_);
     bytes_read_ = 128;
@@ -214,10 +377,10 @@ const char * MatlabIO::readVariableTag(uint32_t &data_type, uint32_t &dbytes, ui
  * @param real
  * @return
  */
-MatlabIOContainer MatlabIO::constructStruct(vector<char>& name, vector<uint32_t>& dims, vector<char>& real) {
+MatlabIOContainer MatlabIO::constructStruct(vector<char>& name, vector<uint32_t>& dims, const char *real) {
 
 	vector<vector<MatlabIOContainer> > array;
-	const char* real_ptr = &(real[0]);
+	const char* real_ptr = real;
 	// get the length of each field
 	uint32_t length_type;
 	uint32_t length_dbytes;
@@ -251,14 +414,14 @@ MatlabIOContainer MatlabIO::constructStruct(vector<char>& name, vector<uint32_t>
 			uint32_t wbytes;
 			const char* data_ptr = readVariableTag(data_type, dbytes, wbytes, field_ptr);
 			assert(data_type == MAT_MATRIX);
-			field = collateMatrixFields(data_type, dbytes, vector<char>(data_ptr, data_ptr+dbytes));
+			field = collateMatrixFields(data_type, dbytes, data_ptr);
 			field.setName(field_names[n]);
-			strct.push_back(field);
+			strct.push_back(std::move(field));
 			field_ptr += wbytes;
 		}
-		array.push_back(strct);
+		array.push_back(std::move(strct));
 	}
-	return MatlabIOContainer(string(&(name[0])), array);
+	return MatlabIOContainer(string(&(name[0])), std::move(array));
 }
 
 /*! @brief construct a cell array
@@ -275,10 +438,10 @@ MatlabIOContainer MatlabIO::constructStruct(vector<char>& name, vector<uint32_t>
  * @param real the real part
  * @return the wrapped cell array
  */
-MatlabIOContainer MatlabIO::constructCell(vector<char>& name, vector<uint32_t>& dims, vector<char>& real) {
+MatlabIOContainer MatlabIO::constructCell(vector<char>& name, vector<uint32_t>& dims, const char *real) {
 
 	vector<MatlabIOContainer> cell;
-	char* field_ptr = &(real[0]);
+	const char* field_ptr = real;
 	for (unsigned int n = 0; n < product<uint32_t>(dims); ++n) {
 		MatlabIOContainer field;
 		uint32_t data_type;
@@ -287,11 +450,11 @@ MatlabIOContainer MatlabIO::constructCell(vector<char>& name, vector<uint32_t>&
 		const char* data_ptr = readVariableTag(data_type, dbytes, wbytes, field_ptr);
 		//printf("cell data_type: %d,  dbytes: %d\n", data_type, dbytes);
 		assert(data_type == MAT_MATRIX);
-		field = collateMatrixFields(data_type, dbytes, vector<char>(data_ptr, data_ptr+dbytes));
-		cell.push_back(field);
+		field = collateMatrixFields(data_type, dbytes, data_ptr);
+		cell.push_back(std::move(field));
 		field_ptr += wbytes;
 	}
-	return MatlabIOContainer(string(&(name[0])), cell);
+	return MatlabIOContainer(string(&(name[0])), std::move(cell));
 }
 
 /*! @brief construct a sparse matrix
@@ -303,7 +466,7 @@ MatlabIOContainer MatlabIO::constructCell(vector<char>& name, vector<uint32_t>&
  * @param imag
  * @return
  */
-MatlabIOContainer MatlabIO::constructSparse(vector<char>&, vector<uint32_t>&, vector<char>&, vector<char>&) {
+MatlabIOContainer MatlabIO::constructSparse(vector<char>&, vector<uint32_t>&, const char *, const char *) {
 
 	MatlabIOContainer variable;
 	return variable;
@@ -317,12 +480,12 @@ MatlabIOContainer MatlabIO::constructSparse(vector<char>&, vector<uint32_t>&, ve
  * @param name the variable name
  * @param dims the variable dimensionality (ignored)
  * @param real the string data
+ * @param real_bytes the number of bytes of the string data
  * @return the wrapped string
  */
-MatlabIOContainer MatlabIO::constructString(vector<char>& name, vector<uint32_t>&, vector<char>& real) {
-	// make sure the data is null terminated
-	real.push_back('\0');
-	return MatlabIOContainer(string(&(name[0])), string(&(real[0])));
+MatlabIOContainer MatlabIO::constructString(vector<char>& name, vector<uint32_t>&, const char *real, uint32_t real_bytes) {
+	// the data is not necessarily null terminated
+	return MatlabIOContainer(string(&(name[0])), string(real, strnlen(real, real_bytes)));
 }
 
 
@@ -336,101 +499,52 @@ MatlabIOContainer MatlabIO::constructString(vector<char>& name, vector<uint32_t>
  * The type of the variable returned should necessarily be double, since
  * it's impossible to know at compile time which data types Matlab has decided
  * to store a set of variables in.
+ * The conversion and the transposition from the column major order are done
+ * in a single pass straight into the output matrix.
+ * A real vector stored in its own type directly in the mapped file is returned
+ * as a view over the mapping without any copy, as its column major layout is
+ * the same as the row major one.
  *
  * @param name the variable name
  * @param dims the variable dimensionality (i, j, k, ...)
  * @param real the real part
- * @param imag the imaginary part (imag.size() == 0 if the data is real)
+ * @param real_bytes the number of bytes of the real part
+ * @param imag the imaginary part
+ * @param imag_bytes the number of bytes of the imaginary part (0 if the data is real)
  * @param stor_type the storage type of the value
  * @return the wrapped matrix
  */
 template<class T>
-MatlabIOContainer MatlabIO::constructMatrix(vector<char>& name, vector<uint32_t>& dims, vector<char>& real, vector<char>& imag, uint32_t stor_type) {
-
-	vector<T> vec_real;
-	vector<T> vec_imag;
-	vector<Mat> vec_mat;
-	Mat flat;
-	Mat mat;
-	switch (stor_type) {
-		case MAT_INT8:
-			vec_real = convertPrimitiveType<int8_t, T>(real);
-			vec_imag = convertPrimitiveType<int8_t, T>(imag);
-			break;
-		case MAT_UINT8:
-			vec_real = convertPrimitiveType<uint8_t, T>(real);
-			vec_imag = convertPrimitiveType<uint8_t, T>(imag);
-			break;
-		case MAT_INT16:
-			vec_real = convertPrimitiveType<int16_t, T>(real);
-			vec_imag = convertPrimitiveType<int16_t, T>(imag);
-			break;
-		case MAT_UINT16:
-			vec_real = convertPrimitiveType<uint16_t, T>(real);
-			vec_imag = convertPrimitiveType<uint16_t, T>(imag);
-			break;
-		case MAT_INT32:
-			vec_real = convertPrimitiveType<int32_t, T>(real);
-			vec_imag = convertPrimitiveType<int32_t, T>(imag);
-			break;
-		case MAT_UINT32:
-			vec_real = convertPrimitiveType<uint32_t, T>(real);
-			vec_imag = convertPrimitiveType<uint32_t, T>(imag);
-			break;
-		case MAT_INT64:
-			vec_real = convertPrimitiveType<int64_t, T>(real);
-			vec_imag = convertPrimitiveType<int64_t, T>(imag);
-			break;
-		case MAT_UINT64:
-			vec_real = convertPrimitiveType<uint64_t, T>(real);
-			vec_imag = convertPrimitiveType<uint64_t, T>(imag);
-			break;
-		case MAT_FLOAT:
-			vec_real = convertPrimitiveType<float, T>(real);
-			vec_imag = convertPrimitiveType<float, T>(imag);
-			break;
-		case MAT_DOUBLE:
-			vec_real = convertPrimitiveType<double, T>(real);
-			vec_imag = convertPrimitiveType<double, T>(imag);
-			break;
-		case MAT_UTF8:
-			vec_real = convertPrimitiveType<char, T>(real);
-			vec_imag = convertPrimitiveType<char, T>(imag);
-			break;
-		default:
-			return MatlabIOContainer();
+MatlabIOContainer MatlabIO::constructMatrix(vector<char>& name, vector<uint32_t>& dims, const char *real, uint32_t real_bytes, const char *imag, uint32_t imag_bytes, uint32_t stor_type) {
+
+	// zero-copy view over the mapped file
+	if (isMapped(real) && imag_bytes == 0 && dims.size() == 2 && (dims[0] == 1 || dims[1] == 1) &&
+		stor_type == MatlabStorageType<T>::value && real_bytes == (uint64_t)dims[0] * dims[1] * sizeof(T) &&
+		reinterpret_cast<uintptr_t>(real) % sizeof(T) == 0) {
+		Mat view(dims[0], dims[1], DataType<T>::type, const_cast<char *>(real));
+		shareMapping(view, mapping_);
+		return MatlabIOContainer(string(&(name[0])), view);
 	}
 
-	// assert that the conversion has not modified the number of elements
-	uint32_t numel = 1;
-	for (unsigned int n = 0; n < dims.size(); ++n) numel *= dims[n];
-	assert(vec_real.size() == numel);
+	// the parts are read straight from the block (or the mapped file), so they
+	// must hold exactly the number of elements given by the dimensions
+	const size_t stor_size = storageSize(stor_type);
+	if (stor_size == 0 || dims.size() < 2) return MatlabIOContainer();
+	uint64_t numel = 1;
+	for (size_t n = 0; n < dims.size() && numel <= real_bytes; ++n) numel *= dims[n];
+	if (real_bytes % stor_size != 0 || numel != real_bytes / stor_size) return MatlabIOContainer();
+	if (imag_bytes != 0 && imag_bytes != real_bytes) return MatlabIOContainer();
 
-	// if the data is a scalar, don't write it to a matrix
-	//if (vec_real.size() == 1 && vec_imag.size() == 0) return MatlabIOContainer(string(&(name[0])), vec_real[0]);
-
-	// get the number of channels
+	// get the number of channels, the imaginary planes follow the real ones
 	const unsigned int channels = dims.size() == 3 ? dims[2] : 1;
-	bool complx = vec_imag.size() != 0;
-
-	// put each plane of the image into a vector
-	vector<Mat> sflat;
-	flat = Mat(vec_real, true);
-	for (unsigned int n = 0; n < channels; ++n)
-		sflat.push_back(flat(Range(dims[0]*dims[1]*n, dims[0]*dims[1]*(n+1)), Range::all()));
-	flat = Mat(vec_imag, true);
-	for (unsigned int n = 0; n < channels*complx; ++n)
-		sflat.push_back(flat(Range(dims[0]*dims[1]*n, dims[0]*dims[1]*(n+1)), Range::all()));
-
-	// merge the planes into a matrix
-	merge(sflat, flat);
-
-	// reshape to the image dimensions
-	mat = flat.reshape(flat.channels(), dims[1]);
-
-	// transpose the matrix since matlab stores them in column major ordering
-	transposeMat(mat, mat);
-
+	const bool complx = imag_bytes != 0;
+	if (channels == 0 || channels * (complx ? 2 : 1) > CV_CN_MAX) return MatlabIOContainer();
+	const size_t plane_bytes = (size_t)dims[0] * dims[1] * stor_size;
+	Mat mat(dims[0], dims[1], CV_MAKETYPE(DataType<T>::depth, channels * (complx ? 2 : 1)));
+	for (unsigned int n = 0; n < channels; ++n) {
+		transposeConvert<T>(stor_type, real + n * plane_bytes, mat, 0, dims[1], n);
+		if (complx) transposeConvert<T>(stor_type, imag + n * plane_bytes, mat, 0, dims[1], channels + n);
+	}
 	return MatlabIOContainer(string(&(name[0])), mat);
 }
 
@@ -449,7 +563,7 @@ MatlabIOContainer MatlabIO::constructMatrix(vector<char>& name, vector<uint32_t>
  *
  * @return the variable (matrix, struct, cell, scalar) wrapped in a container
  */
-MatlabIOContainer MatlabIO::collateMatrixFields(uint32_t, uint32_t, vector<char> data) {
+MatlabIOContainer MatlabIO::collateMatrixFields(uint32_t, uint32_t, const char *data) {
 
     // get the flags
     bool complx  = data[9] & (1 << 3);
@@ -484,11 +598,9 @@ MatlabIOContainer MatlabIO::collateMatrixFields(uint32_t, uint32_t, vector<char>
 
     // if the encoded data type is a cell array, bail out now
     if (enc_data_type == MAT_CELL_CLASS) {
-    	vector<char> real(data.begin() + pre_wbytes+dim_wbytes+name_wbytes, data.end());
-    	return constructCell(name, dims, real);
+    	return constructCell(name, dims, data + pre_wbytes+dim_wbytes+name_wbytes);
     } else if (enc_data_type == MAT_STRUCT_CLASS) {
-    	vector<char> real(data.begin() + pre_wbytes+dim_wbytes+name_wbytes, data.end());
-    	return constructStruct(name, dims, real);
+    	return constructStruct(name, dims, data + pre_wbytes+dim_wbytes+name_wbytes);
     }
 
     // get the real data
@@ -496,38 +608,36 @@ MatlabIOContainer MatlabIO::collateMatrixFields(uint32_t, uint32_t, vector<char>
     uint32_t real_dbytes;
     uint32_t real_wbytes;
     const char* real_data = readVariableTag(real_type, real_dbytes, real_wbytes, &(data[pre_wbytes+dim_wbytes+name_wbytes]));
-    vector<char> real(real_data,real_data+real_dbytes);
     //printf("The variable type is: %d\n", enc_data_type);
     //printf("Total number of bytes in data segment: %d\n", real_dbytes);
 
-    vector<char> imag;
+    const char* imag_data = NULL;
+    uint32_t imag_dbytes = 0;
     if (complx) {
     	// get the imaginery data
     	uint32_t imag_type;
-    	uint32_t imag_dbytes;
     	uint32_t imag_wbytes;
-    	const char* imag_data = readVariableTag(imag_type, imag_dbytes, imag_wbytes, &(data[pre_wbytes+dim_wbytes+name_wbytes+real_wbytes]));
+    	imag_data = readVariableTag(imag_type, imag_dbytes, imag_wbytes, &(data[pre_wbytes+dim_wbytes+name_wbytes+real_wbytes]));
     	assert(imag_type == real_type);
-    	for ( ; imag_data != imag_data+imag_dbytes; imag_data++) imag.push_back(*imag_data);
     }
 
     // construct whatever object we happened to get
     MatlabIOContainer variable;
     switch (enc_data_type) {
     	// integral types
-    	case MAT_INT8_CLASS:      variable = constructMatrix<int8_t>(name, dims, real, imag, real_type); break;
-        case MAT_UINT8_CLASS:     variable = constructMatrix<uint8_t>(name, dims, real, imag, real_type); break;
-        case MAT_INT16_CLASS:     variable = constructMatrix<int16_t>(name, dims, real, imag, real_type); break;
-        case MAT_UINT16_CLASS:    variable = constructMatrix<uint16_t>(name, dims, real, imag, real_type); break;
-        case MAT_INT32_CLASS:     variable = constructMatrix<int32_t>(name, dims, real, imag, real_type); break;
-        case MAT_UINT32_CLASS:    variable = constructMatrix<uint32_t>(name, dims, real, imag, real_type); break;
-        case MAT_FLOAT_CLASS:     variable = constructMatrix<float>(name, dims, real, imag, real_type); break;
-        case MAT_DOUBLE_CLASS:    variable = constructMatrix<double>(name, dims, real, imag, real_type); break;
-        case MAT_INT64_CLASS:     variable = constructMatrix<int64_t>(name, dims, real, imag, real_type); break;
-        case MAT_UINT64_CLASS:    variable = constructMatrix<uint64_t>(name, dims, real, imag, real_type); break;
-        case MAT_CHAR_CLASS:      variable = constructString(name, dims, real); break;
+    	case MAT_INT8_CLASS:      variable = constructMatrix<int8_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_UINT8_CLASS:     variable = constructMatrix<uint8_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_INT16_CLASS:     variable = constructMatrix<int16_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_UINT16_CLASS:    variable = constructMatrix<uint16_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_INT32_CLASS:     variable = constructMatrix<int32_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_UINT32_CLASS:    variable = constructMatrix<uint32_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_FLOAT_CLASS:     variable = constructMatrix<float>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_DOUBLE_CLASS:    variable = constructMatrix<double>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_INT64_CLASS:     variable = constructMatrix<int64_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_UINT64_CLASS:    variable = constructMatrix<uint64_t>(name, dims, real_data, real_dbytes, imag_data, imag_dbytes, real_type); break;
+        case MAT_CHAR_CLASS:      variable = constructString(name, dims, real_data, real_dbytes); break;
         // sparse types
-        case MAT_SPARSE_CLASS:    variable = constructSparse(name, dims, real, imag); break;
+        case MAT_SPARSE_CLASS:    variable = constructSparse(name, dims, real_data, imag_data); break;
         // non-handled types
         case MAT_OBJECT_CLASS:	  break;
         default: 				  break;
@@ -540,47 +650,221 @@ MatlabIOContainer MatlabIO::collateMatrixFields(uint32_t, uint32_t, vector<char>
  * If the data type of a variable is MAT_COMPRESSED, then the binary data blob
  * has been compressed using zlib compression. This function uncompresses the blob,
  * then calls readVariable() to interpret the actual data
+ * The function is called by the threads of read(), so a failure is only
+ * returned and left to be reported by the caller.
  *
  * @param data_type the type of the data stored in the binary blob
  * @param dbytes the number of bytes that constitue the binary blob
  * @param wbytes the whole number of bytes that consistute the header,
  * the binary blob, and any padding to 64-bit boundaries
  * @param data the binary blob
- * @return the binary blob, uncompressed
+ * @param nbytes the number of bytes of the binary blob
+ * @param udata the returned binary blob, uncompressed
+ * @return true if the whole variable was inflated
  */
-vector<char> MatlabIO::uncompressVariable(uint32_t& data_type, uint32_t& dbytes, uint32_t& wbytes, const vector<char> &data) {
+bool MatlabIO::uncompressVariable(uint32_t& data_type, uint32_t& dbytes, uint32_t& wbytes, const char *data, uint32_t nbytes, vector<char>& udata) {
     // setup the inflation parameters
     char buf[8];
     z_stream infstream;
     infstream.zalloc = Z_NULL;
     infstream.zfree  = Z_NULL;
     infstream.opaque = Z_NULL;
-    int ok = inflateInit(&infstream);
-    if (ok != Z_OK) { cerr << "Unable to inflate variable" << endl; exit(-5); }
+    if (inflateInit(&infstream) != Z_OK) return false;
 
     // inflate the variable header
-    infstream.avail_in = data.size();
-    infstream.next_in = (unsigned char *)&(data[0]);
+    infstream.avail_in = nbytes;
+    infstream.next_in = (unsigned char *)data;
     infstream.avail_out = 8;
     infstream.next_out = (unsigned char *)&buf;
-    ok = inflate(&infstream, Z_NO_FLUSH);
-    if (ok != Z_OK) { cerr << "Unable to inflate variable" << endl; exit(-5); }
+    int ok = inflate(&infstream, Z_NO_FLUSH);
+    if ((ok != Z_OK && ok != Z_STREAM_END) || infstream.avail_out != 0) {
+        inflateEnd(&infstream);
+        return false;
+    }
 
     // get the headers
+    if (byte_swap_) EFStream::swapEndian(buf, 8, sizeof(uint32_t));
     readVariableTag(data_type, dbytes, wbytes, buf);
 
     // inflate the remainder of the variable, now that we know its size
-    char *udata_tmp = new char[dbytes];
+    udata.resize(dbytes);
     infstream.avail_out = dbytes;
-    infstream.next_out = (unsigned char *)udata_tmp;
+    infstream.next_out = (unsigned char *)udata.data();
     inflate(&infstream, Z_FINISH);
     inflateEnd(&infstream);
+    if (infstream.avail_out != 0) return false;
+    if (byte_swap_ && data_type == MAT_MATRIX) swapElements(udata.data(), dbytes);
+    return true;
+}
+
+/*! @brief inflate an exact number of bytes
+ *
+ * @param infstream the stream being inflated
+ * @param out the output buffer
+ * @param nbytes the number of bytes to inflate into out
+ * @return true if all the bytes were inflated
+ */
+static bool inflateExactly(z_stream& infstream, char *out, size_t nbytes) {
+    infstream.next_out = (unsigned char *)out;
+    infstream.avail_out = nbytes;
+    while (infstream.avail_out > 0) {
+        int ok = inflate(&infstream, Z_NO_FLUSH);
+        if (ok == Z_STREAM_END) break;
+        if (ok != Z_OK) return false;
+    }
+    return infstream.avail_out == 0;
+}
+
+/*! @brief inflate the planes of a numeric matrix into the output
+ *
+ * The planes are inflated a few columns at a time into a small buffer,
+ * then converted and transposed into the output, so the whole uncompressed
+ * data never has to be held in memory.
+ *
+ * @param infstream the stream positioned at the data of the planes
+ * @param stor_type the storage type of the data
+ * @param mat the output matrix
+ * @param channel0 the output channel of the first plane
+ * @param planes the number of planes
+ * @return true if the planes were inflated
+ */
+template<class T>
+static bool inflatePlanes(z_stream& infstream, uint32_t stor_type, Mat& mat, int channel0, int planes) {
+    const size_t column_bytes = mat.rows * storageSize(stor_type);
+    const int chunk_cols = max<size_t>(1, (1 << 20) / column_bytes);
+    vector<char> buf(min(chunk_cols, mat.cols) * column_bytes);
+    for (int n = 0; n < planes; ++n) {
+        for (int c = 0; c < mat.cols; c += chunk_cols) {
+            const int ncols = min(chunk_cols, mat.cols - c);
+            if (!inflateExactly(infstream, &(buf[0]), ncols * column_bytes)) return false;
+            if (!transposeConvert<T>(stor_type, &(buf[0]), mat, c, ncols, channel0 + n)) return false;
+        }
+    }
+    return true;
+}
+
+/*! @brief inflate the real and imaginary parts of a numeric matrix
+ *
+ * @param infstream the stream positioned after the tag of the real part
+ * @param dims the variable dimensionality
+ * @param real_type the storage type of the real part
+ * @param real_dbytes the number of bytes of the real part
+ * @param complx whether the imaginary part follows
+ * @param mat the returned matrix
+ * @return true if the matrix was inflated
+ */
+template<class T>
+static bool inflateNumeric(z_stream& infstream, const vector<uint32_t>& dims, uint32_t real_type, uint32_t real_dbytes, bool complx, Mat& mat) {
+    const int channels = dims.size() == 3 ? dims[2] : 1;
+    mat.create(dims[0], dims[1], CV_MAKETYPE(DataType<T>::depth, channels * (complx ? 2 : 1)));
+    if (!inflatePlanes<T>(infstream, real_type, mat, 0, channels)) return false;
+    if (!complx) return true;
+
+    // skip the padding of the real part and the tag of the imaginary part
+    char buf[16];
+    const size_t padding = (8 - real_dbytes % 8) % 8;
+    if (!inflateExactly(infstream, buf, padding + 8)) return false;
+    const uint32_t *tag = reinterpret_cast<const uint32_t *>(buf + padding);
+    if (tag[0] != real_type || tag[1] != real_dbytes) return false;
+    return inflatePlanes<T>(infstream, real_type, mat, channels, channels);
+}
+
+/*! @brief inflate a compressed numeric matrix straight into a cv::Mat
+ *
+ * Only the headers are inflated into temporary buffers, the data is inflated
+ * in chunks which are converted and transposed directly into the output, so
+ * the peak memory stays close to the size of the output. Other variables
+ * are left to uncompressVariable(), and so are the variables of byte swapped
+ * files, which are swapped as a whole once inflated.
+ *
+ * @param data the compressed binary blob
+ * @param nbytes the number of bytes of the compressed binary blob
+ * @param variable the returned variable
+ * @return true if the variable was a numeric matrix and has been inflated
+ */
+bool MatlabIO::inflateMatrix(const char *data, uint32_t nbytes, MatlabIOContainer& variable) {
+
+    if (byte_swap_) return false;
+    z_stream infstream;
+    infstream.zalloc = Z_NULL;
+    infstream.zfree  = Z_NULL;
+    infstream.opaque = Z_NULL;
+    infstream.avail_in = nbytes;
+    infstream.next_in = (unsigned char *)data;
+    if (inflateInit(&infstream) != Z_OK) return false;
+
+    // the matrix tag and the preamble
+    char tag[8];
+    char preamble[16] = { 0 };
+    uint32_t data_type;
+    uint32_t dbytes;
+    uint32_t wbytes;
+    bool ok = inflateExactly(infstream, tag, 8);
+    if (ok) readVariableTag(data_type, dbytes, wbytes, tag);
+    ok = ok && data_type == MAT_MATRIX && inflateExactly(infstream, preamble, 16);
+    const char enc_data_type = preamble[8];
+    const bool complx = preamble[9] & (1 << 3);
+    ok = ok && enc_data_type >= MAT_DOUBLE_CLASS && enc_data_type <= MAT_UINT64_CLASS;
+
+    // the dimensions
+    vector<uint32_t> dims;
+    if (ok && (ok = inflateExactly(infstream, tag, 8))) {
+        const char *dim_data = readVariableTag(data_type, dbytes, wbytes, tag);
+        vector<char> buf;
+        if (wbytes > 8) {
+            buf.resize(wbytes - 8);
+            ok = inflateExactly(infstream, &(buf[0]), wbytes - 8);
+            dim_data = &(buf[0]);
+        }
+        const uint32_t *dims_ptr = reinterpret_cast<const uint32_t *>(dim_data);
+        dims.assign(dims_ptr, dims_ptr + dbytes / sizeof(uint32_t));
+    }
+    ok = ok && (dims.size() == 2 || dims.size() == 3) && product<uint32_t>(dims) > 0;
+
+    // the name
+    vector<char> name;
+    if (ok && (ok = inflateExactly(infstream, tag, 8))) {
+        const char *name_data = readVariableTag(data_type, dbytes, wbytes, tag);
+        if (wbytes > 8) {
+            name.resize(wbytes - 8);
+            ok = inflateExactly(infstream, &(name[0]), wbytes - 8);
+            name.resize(dbytes);
+        } else {
+            name.assign(name_data, name_data + dbytes);
+        }
+        name.push_back('\0');
+    }
 
-    // convert to a vector
-    vector<char> udata(udata_tmp, udata_tmp+dbytes);
-    delete [] udata_tmp;
-    return udata;
+    // the tag of the real part
+    uint32_t real_type = 0;
+    uint32_t real_dbytes = 0;
+    if (ok && (ok = inflateExactly(infstream, tag, 8))) {
+        uint32_t real_wbytes;
+        readVariableTag(real_type, real_dbytes, real_wbytes, tag);
+        ok = storageSize(real_type) > 0 && real_dbytes == product<uint32_t>(dims) * storageSize(real_type);
+    }
+
+    // the data
+    Mat mat;
+    if (ok) {
+        switch (enc_data_type) {
+            case MAT_INT8_CLASS:   ok = inflateNumeric<int8_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_UINT8_CLASS:  ok = inflateNumeric<uint8_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_INT16_CLASS:  ok = inflateNumeric<int16_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_UINT16_CLASS: ok = inflateNumeric<uint16_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_INT32_CLASS:  ok = inflateNumeric<int32_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_UINT32_CLASS: ok = inflateNumeric<uint32_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_FLOAT_CLASS:  ok = inflateNumeric<float>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_DOUBLE_CLASS: ok = inflateNumeric<double>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_INT64_CLASS:  ok = inflateNumeric<int64_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            case MAT_UINT64_CLASS: ok = inflateNumeric<uint64_t>(infstream, dims, real_type, real_dbytes, complx, mat); break;
+            default: ok = false; break;
+        }
+    }
+    inflateEnd(&infstream);
 
+    if (ok) variable = MatlabIOContainer(string(&(name[0])), mat);
+    return ok;
 }
 
 /*! @brief Interpret a variable from a binary block of data
@@ -593,7 +877,7 @@ vector<char> MatlabIO::uncompressVariable(uint32_t& data_type, uint32_t& dbytes,
  * @param data the binary blob
  * @return an interpreted variable
  */
-MatlabIOContainer MatlabIO::readVariable(uint32_t data_type, uint32_t nbytes, const vector<char> &data) {
+MatlabIOContainer MatlabIO::readVariable(uint32_t data_type, uint32_t nbytes, const char *data) {
 
     // interpret the data
     MatlabIOContainer variable;
@@ -615,12 +899,19 @@ MatlabIOContainer MatlabIO::readVariable(uint32_t data_type, uint32_t nbytes, co
     */
         case MAT_COMPRESSED:
         {
+            // numeric matrices are inflated directly into the output
+            if (inflateMatrix(data, nbytes, variable)) break;
+
             // uncompress the data
             uint32_t udata_type;
             uint32_t udbytes;
             uint32_t uwbytes;
-            vector<char> udata = uncompressVariable(udata_type, udbytes, uwbytes, data);
-            variable = readVariable(udata_type, udbytes, udata);
+            vector<char> udata;
+            if (!uncompressVariable(udata_type, udbytes, uwbytes, data, nbytes, udata)) {
+                cerr << "Unable to inflate variable in " << filename_ << endl;
+                break;
+            }
+            variable = readVariable(udata_type, udbytes, udata.data());
             break;
         }
         case MAT_MATRIX:
@@ -637,34 +928,31 @@ MatlabIOContainer MatlabIO::readVariable(uint32_t data_type, uint32_t nbytes, co
 /*! @brief read a block of data from the file being parsed
  *
  * This function attempts to read an entire variable from the file being parsed.
- * The data block is then encapsulated in a vector and passed onto readVariable()
+ * The data block is then encapsulated in a vector and later passed onto readVariable()
  * for interpretation. This design means that the file is touched a minimal number
  * of times, and later manipulation of the data can make use of automatic memory
  * management, reference counting, etc.
  *
- * @return the block of data interpreted as a variable and stored in a generic container
+ * @param data_type the returned data type of the block
+ * @param dbytes the returned number of bytes of the block
+ * @param data the vector receiving the block
+ * @return a pointer to the block data
  */
-MatlabIOContainer MatlabIO::readBlock(void) {
-
-    // allocate the output
-    MatlabIOContainer variable;
+const char * MatlabIO::readBlock(uint32_t& data_type, uint32_t& dbytes, vector<char>& data) {
 
     // get the data type and number of bytes consumed
     // by this variable. Check to see if it's using
     // the small data format (seriously, who thought of that? You save at best 8 bytes...)
-    uint32_t data_type;
-    uint32_t dbytes;
     uint32_t wbytes;
     char buf[8];
-    fid_.read(buf, sizeof(char)*8);
+    fid_.read(buf, sizeof(char)*8, sizeof(uint32_t));
     readVariableTag(data_type, dbytes, wbytes, buf);
 
     // read the binary data block
     //printf("\nReading binary data block...\n"); fflush(stdout);
-    char *data_tmp = new char[dbytes];
-    fid_.read(data_tmp, sizeof(char)*dbytes);
-    vector<char> data(data_tmp, data_tmp+dbytes);
-    delete [] data_tmp;
+    data.resize(dbytes);
+    fid_.read(&(data[0]), sizeof(char)*dbytes);
+    if (byte_swap_ && data_type == MAT_MATRIX) swapElements(&(data[0]), dbytes);
 
     // move the seek head position to the next 64-bit boundary
     // (but only if the data is uncompressed. Saving yet another 8 tiny bytes...)
@@ -674,12 +962,58 @@ MatlabIOContainer MatlabIO::readBlock(void) {
         int padding = head_pos % 8;
         fid_.seekg(padding, fstream::cur);
     }
+    return &(data[0]);
+}
+
+/*! @brief locate a block of data in the mapped file
+ *
+ * The mapped counterpart of readBlock(), the data block is left in place
+ * in the mapping rather than read into memory.
+ *
+ * @param data_type the returned data type of the block
+ * @param dbytes the returned number of bytes of the block
+ * @return a pointer to the block data, NULL if the block is truncated
+ */
+const char * MatlabIO::readMappedBlock(uint32_t& data_type, uint32_t& dbytes) {
+
+    uint32_t wbytes;
+    if (map_pos_ + 8 > map_size_) {
+        map_pos_ = map_size_;
+        return NULL;
+    }
+    const char *data = readVariableTag(data_type, dbytes, wbytes, map_ + map_pos_);
+    if (map_pos_ + 8 + (uint64_t)dbytes > map_size_) {
+        cerr << "Truncated variable in " << filename_ << endl;
+        map_pos_ = map_size_;
+        return NULL;
+    }
 
-    // now read the variable contained in the block
-    return readVariable(data_type, dbytes, data);
+    // move to the next variable (the padding is included unless compressed)
+    map_pos_ += wbytes;
+    return data;
 }
 
 
+/*! @struct MatlabIOBlock
+ *  @brief Block of a variable read ahead by read()
+ */
+struct MatlabIOBlock {
+    enum State { INFLATE, INFLATING, DONE };
+    uint32_t data_type;
+    uint32_t nbytes;
+    const char *data;
+    // the block when the file is not mapped
+    vector<char> buffer;
+    State state;
+    // a numeric matrix inflated directly, or the uncompressed variable
+    MatlabIOContainer inflated;
+    bool is_inflated;
+    vector<char> udata;
+    uint32_t udata_type;
+    uint32_t udbytes;
+    bool failed;
+};
+
 /*! @brief Read all variables from a file
  *
  * Reads every variable encountered when parsing a valid Matlab .Mat file.
@@ -689,34 +1023,879 @@ MatlabIOContainer MatlabIO::readBlock(void) {
  * Note: Matlab stores images in RGB format whereas OpenCV stores images in
  * BGR format, so if displaying a parsed image using cv::imshow(), the
  * colours will be inverted.
+ * The blocks are read at most num_threads ahead of the variable being
+ * interpreted, the compressed ones are inflated concurrently by the pool
+ * and the calling thread, and the variables are interpreted in the file order,
+ * so only the blocks of the window are held in memory at once. A variable
+ * which fails to inflate is reported and skipped.
+ * @param num_threads the number of threads inflating the compressed variables
+ * (0 for the number of cores)
  * @return a vector of containers storing the name and data of each variable
  * in the file
  */
-std::vector<MatlabIOContainer> MatlabIO::read(void) {
+std::vector<MatlabIOContainer> MatlabIO::read(int num_threads) {
 
     // allocate the output
     std::vector<MatlabIOContainer> variables;
 
-    // read the header information
+    // read the header information (the stream may have been used by index())
+    fid_.clear();
+    fid_.seekg(0, fstream::beg);
     getHeader();
 
-    // get all of the variables
-    while(hasVariable()) {
+    // the blocks are read in place if the file is mapped
+    // (byte swapped files are read through the stream)
+    const bool mapped = map_ != NULL && !byte_swap_;
+    map_pos_ = 128;
+    if (num_threads <= 0) num_threads = max(1u, thread::hardware_concurrency());
+
+    // blocks read and not interpreted yet, the references to them stay valid
+    // while other blocks are appended or the first one removed
+    deque<MatlabIOBlock> blocks;
+    mutex lock;
+    condition_variable inflatable, inflated;
+    bool stop = false;
+    vector<thread> threads;
+
+    // claim the next block to be inflated (under the lock), NULL if there is none
+    auto claim = [&]() -> MatlabIOBlock* {
+        for (size_t n = 0; n < blocks.size(); ++n) {
+            if (blocks[n].state == MatlabIOBlock::INFLATE) {
+                blocks[n].state = MatlabIOBlock::INFLATING;
+                return &blocks[n];
+            }
+        }
+        return NULL;
+    };
+    // inflate a claimed block (without the lock)
+    auto inflateBlock = [&](MatlabIOBlock& block) {
+        if (inflateMatrix(block.data, block.nbytes, block.inflated)) {
+            block.is_inflated = true;
+        } else {
+            uint32_t uwbytes;
+            block.failed = !uncompressVariable(block.udata_type, block.udbytes, uwbytes, block.data, block.nbytes, block.udata);
+        }
+        vector<char>().swap(block.buffer);
+    };
+    auto inflater = [&]() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            MatlabIOBlock *block = claim();
+            if (block == NULL) {
+                if (stop) return;
+                inflatable.wait(guard);
+                continue;
+            }
+            guard.unlock();
+            inflateBlock(*block);
+            guard.lock();
+            block->state = MatlabIOBlock::DONE;
+            inflated.notify_all();
+        }
+    };
+
+    bool more = true;
+    while (true) {
+        // read ahead up to the window, starting an inflater per compressed block
+        // until there are num_threads threads inflating, the calling one included
+        while (more && blocks.size() < (size_t)num_threads) {
+            more = mapped ? map_pos_ < map_size_ : hasVariable();
+            if (!more) break;
+            MatlabIOBlock block;
+            block.data_type = 0;
+            block.nbytes = 0;
+            block.is_inflated = false;
+            block.failed = false;
+            const char *data = mapped ? readMappedBlock(block.data_type, block.nbytes) : readBlock(block.data_type, block.nbytes, block.buffer);
+            if (data == NULL) block.data_type = 0;
+            block.data = data;
+            block.state = block.data_type == MAT_COMPRESSED ? MatlabIOBlock::INFLATE : MatlabIOBlock::DONE;
+            lock_guard<mutex> guard(lock);
+            blocks.push_back(std::move(block));
+            if (blocks.back().state == MatlabIOBlock::INFLATE) {
+                if (threads.size() + 1 < (size_t)num_threads) threads.push_back(thread(inflater));
+                inflatable.notify_one();
+            }
+        }
+        if (blocks.empty()) break;
+
+        // wait for the first block, inflating the others meanwhile
+        unique_lock<mutex> guard(lock);
+        while (blocks.front().state != MatlabIOBlock::DONE) {
+            MatlabIOBlock *block = claim();
+            if (block == NULL) {
+                inflated.wait(guard);
+                continue;
+            }
+            guard.unlock();
+            inflateBlock(*block);
+            guard.lock();
+            block->state = MatlabIOBlock::DONE;
+            inflated.notify_all();
+        }
+        MatlabIOBlock block = std::move(blocks.front());
+        blocks.pop_front();
+        guard.unlock();
+
+        // interpret the variable
+        if (block.failed) {
+            cerr << "Unable to inflate variable in " << filename_ << endl;
+        } else if (block.is_inflated) {
+            variables.push_back(std::move(block.inflated));
+        } else if (block.data_type == MAT_COMPRESSED) {
+            variables.push_back(readVariable(block.udata_type, block.udbytes, block.udata.data()));
+        } else {
+            variables.push_back(readVariable(block.data_type, block.nbytes, block.data));
+        }
+    }
 
-        MatlabIOContainer variable;
-        variable = readBlock();
-        variables.push_back(variable);
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+        inflatable.notify_all();
     }
+    for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
     return variables;
 }
 
+/*! @brief interpret the header of a matrix
+ *
+ * Reads the class, dimensions and name of a matrix from the beginning
+ * of its data, which is all that is needed for the directory
+ *
+ * @param data the beginning of the matrix data
+ * @param nbytes the number of bytes available
+ * @param variable the entry to fill in
+ * @return true if the header fits into the available bytes
+ */
+bool MatlabIO::readMatrixHeader(const char *data, uint32_t nbytes, MatlabIOVariable& variable) {
+
+    // the preamble size is 16 bytes
+    const uint32_t pre_wbytes = 16;
+    if (nbytes < pre_wbytes + 8) return false;
+    variable.class_type = static_cast<unsigned char>(data[8]);
+
+    // get the dimensions
+    uint32_t dim_type;
+    uint32_t dim_dbytes;
+    uint32_t dim_wbytes;
+    const char* dim_data = readVariableTag(dim_type, dim_dbytes, dim_wbytes, data+pre_wbytes);
+    if (pre_wbytes + dim_wbytes + 8 > nbytes) return false;
+    variable.dims.assign(reinterpret_cast<const uint32_t *>(dim_data), reinterpret_cast<const uint32_t *>(dim_data+dim_dbytes));
+
+    // get the variable name
+    uint32_t name_type;
+    uint32_t name_dbytes;
+    uint32_t name_wbytes;
+    const char* name_data = readVariableTag(name_type, name_dbytes, name_wbytes, data+pre_wbytes+dim_wbytes);
+    if (pre_wbytes + dim_wbytes + name_wbytes > nbytes) return false;
+    variable.name = string(name_data, strnlen(name_data, name_dbytes));
+    variable.real_offset = pre_wbytes + dim_wbytes + name_wbytes;
+    return true;
+}
+
+/*! @brief Build the directory of the variables in a file
+ *
+ * Records the name, class, dimensions and position of every top-level variable
+ * without decoding its data. Only the few bytes of the matrix header are read
+ * (and inflated for compressed variables), so the whole file is never loaded.
+ * The directory is used by readVariable(name).
+ * @return the directory entry of every variable in the file
+ */
+vector<MatlabIOVariable> MatlabIO::index(void) {
+
+    // the header is read again, the stream may be anywhere
+    fid_.clear();
+    fid_.seekg(0, fstream::beg);
+    getHeader();
+    directory_.clear();
+
+    // enough for the preamble, the dimensions and the name of any matrix
+    const uint32_t header_bytes = 512;
+    size_t offset = 128;
+    while (hasVariable()) {
+
+        uint32_t data_type;
+        uint32_t dbytes;
+        uint32_t wbytes;
+        char buf[8];
+        fid_.read(buf, sizeof(char)*8, sizeof(uint32_t));
+        if (!fid_) break;
+        readVariableTag(data_type, dbytes, wbytes, buf);
+
+        MatlabIOVariable variable;
+        variable.data_type = data_type;
+        variable.class_type = 0;
+        variable.offset = offset;
+        variable.nbytes = dbytes;
+        variable.real_offset = 0;
+
+        const uint32_t available = min(dbytes, header_bytes);
+        vector<char> packed(available);
+        fid_.read(&(packed[0]), available);
+
+        if (data_type == MAT_COMPRESSED) {
+            // inflate just the tag and the header of the matrix
+            char inflated[8 + header_bytes];
+            z_stream infstream;
+            infstream.zalloc = Z_NULL;
+            infstream.zfree  = Z_NULL;
+            infstream.opaque = Z_NULL;
+            infstream.avail_in = available;
+            infstream.next_in = (unsigned char *)&(packed[0]);
+            infstream.avail_out = sizeof(inflated);
+            infstream.next_out = (unsigned char *)inflated;
+            if (inflateInit(&infstream) == Z_OK) {
+                inflate(&infstream, Z_SYNC_FLUSH);
+                const uint32_t ubytes = sizeof(inflated) - infstream.avail_out;
+                inflateEnd(&infstream);
+                if (byte_swap_) swapElements(inflated, ubytes);
+                uint32_t udata_type;
+                uint32_t udbytes;
+                uint32_t uwbytes;
+                if (ubytes >= 8) {
+                    const char *udata = readVariableTag(udata_type, udbytes, uwbytes, inflated);
+                    if (udata_type == MAT_MATRIX) readMatrixHeader(udata, min(ubytes - 8, udbytes), variable);
+                }
+            }
+        } else if (data_type == MAT_MATRIX) {
+            if (byte_swap_) swapElements(&(packed[0]), available);
+            readMatrixHeader(&(packed[0]), available, variable);
+        }
+        directory_.push_back(variable);
+
+        // skip the rest of the variable
+        offset += wbytes;
+        fid_.clear();
+        fid_.seekg(offset, fstream::beg);
+    }
+    fid_.clear();
+    return directory_;
+}
+
+/*! @brief Read a single variable by name
+ *
+ * Seeks to the variable using the directory (built by index() if it has not
+ * been yet) and decodes only that variable.
+ * @param name the name of the variable
+ * @throw std::exception if there is no such variable
+ * @return the variable
+ */
+MatlabIOContainer MatlabIO::readVariable(string name) {
+
+    if (directory_.empty()) index();
+    for (unsigned int n = 0; n < directory_.size(); ++n) {
+        const MatlabIOVariable& variable = directory_[n];
+        if (variable.name.compare(name) != 0) continue;
+
+        // parse in place when mapped, otherwise read just this block
+        if (map_ != NULL && !byte_swap_ && variable.offset + 8 + variable.nbytes <= map_size_) {
+            return readVariable(variable.data_type, variable.nbytes, map_ + variable.offset + 8);
+        }
+        vector<char> data(variable.nbytes);
+        fid_.clear();
+        fid_.seekg(variable.offset + 8, fstream::beg);
+        fid_.read(&(data[0]), variable.nbytes);
+        if (byte_swap_ && variable.data_type == MAT_MATRIX) swapElements(&(data[0]), variable.nbytes);
+        return readVariable(variable.data_type, variable.nbytes, &(data[0]));
+    }
+    throw new std::exception();
+}
+
+/*! @brief read an array at an absolute position of the file
+ *
+ * Copies from the mapping when the file is mapped, otherwise seeks the stream.
+ * The elements are converted to the native byte order.
+ *
+ * @param offset the position in the file
+ * @param data the output
+ * @param nbytes the number of bytes to read
+ * @param width the width of the elements
+ * @return true if all the bytes were read
+ */
+bool MatlabIO::readBytes(size_t offset, char *data, size_t nbytes, int width) {
+    if (map_ != NULL) {
+        if (offset + nbytes > map_size_) return false;
+        memcpy(data, map_ + offset, nbytes);
+        if (byte_swap_) EFStream::swapEndian(data, nbytes - nbytes % width, width);
+        return true;
+    }
+    fid_.clear();
+    fid_.seekg(offset, fstream::beg);
+    fid_.read(data, nbytes, width);
+    return !fid_.fail();
+}
+
+/*! @brief read a rectangle of every plane of a numeric matrix
+ *
+ * The columns of the rectangle are read a few at a time into a small buffer,
+ * then converted and transposed into the output. Whole columns are contiguous
+ * in the file, so a column range is read with a single read per chunk, while
+ * a narrower rectangle takes one read per column.
+ *
+ * @param variable the directory entry of the variable
+ * @param real the position of the real part data in the file
+ * @param imag the position of the imaginary part data in the file (0 if the data is real)
+ * @param stor_type the storage type of the data
+ * @param roi the rectangle to read
+ * @param mat the returned matrix
+ * @return true if the rectangle was read
+ */
+template<class T>
+bool MatlabIO::readSlice(const MatlabIOVariable& variable, size_t real, size_t imag, uint32_t stor_type, Rect roi, Mat& mat) {
+    const size_t stor_size = storageSize(stor_type);
+    const size_t rows = variable.dims[0];
+    const size_t plane_bytes = rows * variable.dims[1] * stor_size;
+    const int channels = variable.dims.size() == 3 ? variable.dims[2] : 1;
+    mat.create(roi.height, roi.width, CV_MAKETYPE(DataType<T>::depth, channels * (imag ? 2 : 1)));
+    if (roi.area() == 0) return true;
+
+    const size_t column_bytes = roi.height * stor_size;
+    const int chunk_cols = max<size_t>(1, (1 << 20) / column_bytes);
+    vector<char> buf(min(chunk_cols, roi.width) * column_bytes);
+    for (int n = 0; n < channels * (imag ? 2 : 1); ++n) {
+        const size_t plane = (n < channels ? real : imag) + (n % channels) * plane_bytes;
+        for (int c = 0; c < roi.width; c += chunk_cols) {
+            const int ncols = min(chunk_cols, roi.width - c);
+            const size_t first = plane + ((roi.x + c) * rows + roi.y) * stor_size;
+            if ((size_t)roi.height == rows) {
+                if (!readBytes(first, &(buf[0]), ncols * column_bytes, stor_size)) return false;
+            } else {
+                for (int k = 0; k < ncols; ++k) {
+                    if (!readBytes(first + k * rows * stor_size, &(buf[k * column_bytes]), column_bytes, stor_size)) return false;
+                }
+            }
+            if (!transposeConvert<T>(stor_type, &(buf[0]), mat, c, ncols, n)) return false;
+        }
+    }
+    return true;
+}
+
+/*! @brief Read a rectangle of a single variable by name
+ *
+ * Reads only the bytes of the rectangle from an uncompressed numeric matrix,
+ * using the directory (built by index() if it has not been yet) to locate its
+ * data. The result is the same as reading the whole variable and taking the
+ * rectangle of it. Compressed variables cannot be sliced, as there is no way
+ * to seek in a deflate stream.
+ * @param name the name of the variable
+ * @param roi the rectangle (x and width in columns, y and height in rows)
+ * @throw std::exception if there is no such variable, it is not an
+ * uncompressed numeric matrix or the rectangle does not fit into it
+ * @return the rectangle of the variable
+ */
+MatlabIOContainer MatlabIO::readVariable(string name, Rect roi) {
+
+    if (directory_.empty()) index();
+    for (unsigned int n = 0; n < directory_.size(); ++n) {
+        const MatlabIOVariable& variable = directory_[n];
+        if (variable.name.compare(name) != 0) continue;
+
+        if (variable.data_type != MAT_MATRIX || variable.real_offset == 0 ||
+            variable.class_type < MAT_DOUBLE_CLASS || variable.class_type > MAT_UINT64_CLASS ||
+            variable.dims.size() < 2 || variable.dims.size() > 3) break;
+        if (roi.x < 0 || roi.y < 0 || roi.width < 0 || roi.height < 0 ||
+            (size_t)roi.x + roi.width > variable.dims[1] || (size_t)roi.y + roi.height > variable.dims[0]) break;
+
+        // the flags and the tag of the real part
+        const size_t data = variable.offset + 8;
+        char flags[16];
+        char tag[8];
+        if (!readBytes(data, flags, 16, sizeof(uint32_t)) || !readBytes(data + variable.real_offset, tag, 8, sizeof(uint32_t))) break;
+        const bool complx = flags[9] & (1 << 3);
+        uint32_t stor_type;
+        uint32_t real_dbytes;
+        uint32_t real_wbytes;
+        const size_t real = data + variable.real_offset + (readVariableTag(stor_type, real_dbytes, real_wbytes, tag) - tag);
+        if (storageSize(stor_type) == 0 || real_dbytes != product<uint32_t>(variable.dims) * storageSize(stor_type)) break;
+        const size_t imag = complx ? data + variable.real_offset + real_wbytes + 8 : 0;
+
+        Mat mat;
+        bool ok = false;
+        switch (variable.class_type) {
+            case MAT_INT8_CLASS:   ok = readSlice<int8_t>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_UINT8_CLASS:  ok = readSlice<uint8_t>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_INT16_CLASS:  ok = readSlice<int16_t>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_UINT16_CLASS: ok = readSlice<uint16_t>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_INT32_CLASS:  ok = readSlice<int32_t>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_UINT32_CLASS: ok = readSlice<uint32_t>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_FLOAT_CLASS:  ok = readSlice<float>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_DOUBLE_CLASS: ok = readSlice<double>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_INT64_CLASS:  ok = readSlice<int64_t>(variable, real, imag, stor_type, roi, mat); break;
+            case MAT_UINT64_CLASS: ok = readSlice<uint64_t>(variable, real, imag, stor_type, roi, mat); break;
+            default: break;
+        }
+        if (ok) return MatlabIOContainer(name, mat);
+        break;
+    }
+    throw new std::exception();
+}
+
+/*! @brief Read a range of columns of a single variable by name
+ *
+ * @param name the name of the variable
+ * @param col0 the first column
+ * @param ncols the number of columns
+ * @throw std::exception if the columns cannot be read
+ * @return all the rows of the columns [col0, col0+ncols)
+ * @see readVariable(std::string, cv::Rect)
+ */
+MatlabIOContainer MatlabIO::readColumns(string name, int col0, int ncols) {
+
+    if (directory_.empty()) index();
+    for (unsigned int n = 0; n < directory_.size(); ++n) {
+        if (directory_[n].name.compare(name) == 0 && directory_[n].dims.size() >= 2) {
+            return readVariable(name, Rect(col0, 0, ncols, directory_[n].dims[0]));
+        }
+    }
+    throw new std::exception();
+}
+
+/*! @brief Write the .Mat file header
+ *
+ * Writes a version 5 header in the native byte order, the endian indicator
+ * tells the reader whether it has to swap the bytes.
+ */
+void MatlabIO::setHeader(void) {
+    // the human readable text, padded with spaces
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", localtime(&now));
+    memset(header_, ' ', HEADER_LENGTH);
+    header_[HEADER_LENGTH] = '\0';
+    string text = string("MATLAB 5.0 MAT-file, Platform: cvmatio, Created on: ") + date;
+    memcpy(header_, text.c_str(), min<size_t>(text.length(), HEADER_LENGTH));
+    // no subsystem data
+    memset(subsys_, 0, SUBSYS_LENGTH+1);
+    version_ = VERSION_5;
+    byte_swap_ = false;
+    strcpy(endian_, "IM");
+
+    const int16_t version = 0x0100;
+    const int16_t endian = ('M' << 8) | 'I';
+    fid_.write(header_, sizeof(char)*HEADER_LENGTH);
+    fid_.write(subsys_, sizeof(char)*SUBSYS_LENGTH);
+    fid_.write((const char *)&version, sizeof(int16_t));
+    fid_.write((const char *)&endian, sizeof(int16_t));
+}
+
+/*! @class MatlabIOSink
+ *  @brief Destination of the serialized variables
+ *
+ *  Variables are serialized in small pieces either straight into the file
+ *  or through a deflate stream into the compressed block of the variable.
+ */
+class MatlabIOSink {
+public:
+    virtual ~MatlabIOSink() {}
+    virtual bool write(const char *data, size_t nbytes) = 0;
+};
+
+class MatlabIOStreamSink : public MatlabIOSink {
+private:
+    ostream& stream_;
+public:
+    MatlabIOStreamSink(ostream& stream) : stream_(stream) {}
+    bool write(const char *data, size_t nbytes) {
+        stream_.write(data, nbytes);
+        return !stream_.fail();
+    }
+};
+
+class MatlabIODeflateSink : public MatlabIOSink {
+private:
+    z_stream defstream_;
+    vector<char>& out_;
+    bool ok_;
+    bool deflate_(const char *data, size_t nbytes, int flush) {
+        defstream_.next_in = (unsigned char *)data;
+        defstream_.avail_in = nbytes;
+        int res;
+        do {
+            if (out_.size() - defstream_.total_out < (1 << 16)) out_.resize(out_.size() + max<size_t>(1 << 18, out_.size() / 2));
+            defstream_.next_out = (unsigned char *)&(out_[defstream_.total_out]);
+            defstream_.avail_out = out_.size() - defstream_.total_out;
+            res = deflate(&defstream_, flush);
+            if (res == Z_STREAM_ERROR) return false;
+        } while (defstream_.avail_in > 0 || defstream_.avail_out == 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+        return true;
+    }
+public:
+    MatlabIODeflateSink(vector<char>& out, int level) : out_(out) {
+        defstream_.zalloc = Z_NULL;
+        defstream_.zfree  = Z_NULL;
+        defstream_.opaque = Z_NULL;
+        out_.clear();
+        ok_ = deflateInit(&defstream_, level) == Z_OK;
+    }
+    ~MatlabIODeflateSink() { if (ok_) deflateEnd(&defstream_); }
+    bool write(const char *data, size_t nbytes) {
+        return ok_ && (ok_ = deflate_(data, nbytes, Z_NO_FLUSH));
+    }
+    /*! @brief flush the stream and trim the output to the compressed size */
+    bool finish(void) {
+        ok_ = ok_ && deflate_(NULL, 0, Z_FINISH);
+        if (ok_) out_.resize(defstream_.total_out);
+        return ok_;
+    }
+};
+
+/*! @brief size of a data element padded to the 64-bit boundary */
+static uint64_t paddedSize(uint64_t nbytes) {
+    return (nbytes + 7) & ~static_cast<uint64_t>(7);
+}
+
+/*! @brief write the tag of a data element
+ *
+ * @param sink the destination
+ * @param data_type the type of the element
+ * @param nbytes the number of bytes of the element data
+ * @return true if the tag was written
+ */
+static bool writeTag(MatlabIOSink& sink, uint32_t data_type, uint32_t nbytes) {
+    const uint32_t tag[2] = { data_type, nbytes };
+    return sink.write((const char *)tag, sizeof(tag));
+}
+
+/*! @brief write the zero padding after nbytes of element data */
+static bool writePadding(MatlabIOSink& sink, uint64_t nbytes) {
+    const char zeros[8] = { 0 };
+    return sink.write(zeros, paddedSize(nbytes) - nbytes);
+}
+
+/*! @brief write a whole data element: the tag, the data and the padding */
+static bool writeElement(MatlabIOSink& sink, uint32_t data_type, const void *data, uint32_t nbytes) {
+    return writeTag(sink, data_type, nbytes) && sink.write((const char *)data, nbytes) && writePadding(sink, nbytes);
+}
+
+/*! @brief the Matlab class and storage type of a matrix depth
+ *
+ * @return false if the depth has no Matlab equivalent
+ */
+static bool matlabType(int depth, uint32_t& class_type, uint32_t& stor_type) {
+    switch (depth) {
+        case CV_8U:  class_type = MAT_UINT8_CLASS;  stor_type = MAT_UINT8;  break;
+        case CV_8S:  class_type = MAT_INT8_CLASS;   stor_type = MAT_INT8;   break;
+        case CV_16U: class_type = MAT_UINT16_CLASS; stor_type = MAT_UINT16; break;
+        case CV_16S: class_type = MAT_INT16_CLASS;  stor_type = MAT_INT16;  break;
+        case CV_32S: class_type = MAT_INT32_CLASS;  stor_type = MAT_INT32;  break;
+        case CV_32F: class_type = MAT_FLOAT_CLASS;  stor_type = MAT_FLOAT;  break;
+        case CV_64F: class_type = MAT_DOUBLE_CLASS; stor_type = MAT_DOUBLE; break;
+        default: return false;
+    }
+    return true;
+}
+
+/*! @brief get the numeric matrix stored in a container
+ *
+ * Scalars of the primitive types are wrapped in a 1x1 matrix, booleans as
+ * uint8, the types without an OpenCV depth (char, uint32 and the 64 bit
+ * integers) cannot be written
+ *
+ * @return false if the container does not hold a matrix or a scalar
+ */
+static bool numericMatrix(const MatlabIOContainer& variable, Mat& mat) {
+    if (variable.typeEquals<Mat>())      mat = variable.data<Mat>();
+    else if (variable.typeEquals<double>())   mat = Mat(1, 1, CV_64F, Scalar(variable.data<double>()));
+    else if (variable.typeEquals<float>())    mat = Mat(1, 1, CV_32F, Scalar(variable.data<float>()));
+    else if (variable.typeEquals<int32_t>())  mat = Mat(1, 1, CV_32S, Scalar(variable.data<int32_t>()));
+    else if (variable.typeEquals<int16_t>())  mat = Mat(1, 1, CV_16S, Scalar(variable.data<int16_t>()));
+    else if (variable.typeEquals<uint16_t>()) mat = Mat(1, 1, CV_16U, Scalar(variable.data<uint16_t>()));
+    else if (variable.typeEquals<int8_t>())   mat = Mat(1, 1, CV_8S, Scalar(variable.data<int8_t>()));
+    else if (variable.typeEquals<uint8_t>())  mat = Mat(1, 1, CV_8U, Scalar(variable.data<uint8_t>()));
+    else if (variable.typeEquals<bool>())     mat = Mat(1, 1, CV_8U, Scalar(variable.data<bool>()));
+    else return false;
+    return mat.dims <= 2;
+}
+
+/*! @brief the number of bytes of a serialized matrix
+ *
+ * Computes the size of the miMATRIX data (without its tag) before anything
+ * is written, as the tag has to hold it up front.
+ *
+ * @param variable the variable
+ * @param name_length the length of the stored name (0 for cell elements and struct fields)
+ * @param nbytes the returned size
+ * @return false if the variable (or any of its elements) cannot be written
+ */
+static bool matrixBytes(const MatlabIOContainer& variable, size_t name_length, uint64_t& nbytes) {
+    // array flags, dimensions and name
+    nbytes = 16 + 8 + 8 + paddedSize(name_length);
+
+    Mat mat;
+    uint32_t class_type, stor_type;
+    if (numericMatrix(variable, mat)) {
+        if (!matlabType(mat.depth(), class_type, stor_type)) return false;
+        nbytes += (mat.channels() > 1 ? 16 : 8) + 8 + paddedSize(mat.total() * mat.elemSize());
+    } else if (variable.typeEquals<string>()) {
+        nbytes += 8 + 8 + paddedSize(variable.data<string>().length());
+    } else if (variable.typeEquals<vector<MatlabIOContainer> >()) {
+        const vector<MatlabIOContainer>& cell = variable.data<vector<MatlabIOContainer> >();
+        nbytes += 8;
+        for (unsigned int n = 0; n < cell.size(); ++n) {
+            uint64_t field_bytes;
+            if (!matrixBytes(cell[n], 0, field_bytes)) return false;
+            nbytes += 8 + field_bytes;
+        }
+    } else if (variable.typeEquals<vector<vector<MatlabIOContainer> > >()) {
+        const vector<vector<MatlabIOContainer> >& array = variable.data<vector<vector<MatlabIOContainer> > >();
+        const size_t nfields = array.empty() ? 0 : array[0].size();
+        size_t length = 1;
+        for (unsigned int n = 0; n < nfields; ++n) length = max(length, array[0][n].name().length() + 1);
+        nbytes += 8 + 8 + 8 + paddedSize(nfields * length);
+        for (unsigned int m = 0; m < array.size(); ++m) {
+            if (array[m].size() != nfields) return false;
+            for (unsigned int n = 0; n < nfields; ++n) {
+                uint64_t field_bytes;
+                if (!matrixBytes(array[m][n], 0, field_bytes)) return false;
+                nbytes += 8 + field_bytes;
+            }
+        }
+    } else {
+        return false;
+    }
+    return nbytes <= UINT32_MAX;
+}
+
+/*! @brief transpose a block of columns of a matrix into the column major order
+ *
+ * The inverse of transposeConvert(), goes by square tiles as well.
+ *
+ * @param src the row major input
+ * @param col0 the first column
+ * @param ncols the number of columns
+ * @param channel the channel
+ * @param dst the column major output
+ */
+template<class T>
+static void transposeColumns(const Mat& src, int col0, int ncols, int channel, char *dst) {
+    T *out = reinterpret_cast<T *>(dst);
+    const int rows = src.rows;
+    const int cn = src.channels();
+    const int tile = 32;
+    for (int rb = 0; rb < rows; rb += tile) {
+        const int re = min(rb + tile, rows);
+        for (int cb = 0; cb < ncols; cb += tile) {
+            const int ce = min(cb + tile, ncols);
+            for (int r = rb; r < re; ++r) {
+                const T *in = src.ptr<T>(r) + channel;
+                for (int c = cb; c < ce; ++c) out[(size_t)c * rows + r] = in[(col0 + c) * cn];
+            }
+        }
+    }
+}
+
+/*! @brief write the data of a numeric matrix in the column major order
+ *
+ * Each channel is written as a plane, a few columns at a time, so the
+ * transposed data never has to be held in memory at once.
+ */
+template<class T>
+static bool writePlanes(MatlabIOSink& sink, const Mat& mat) {
+    const size_t column_bytes = mat.rows * sizeof(T);
+    if (column_bytes == 0 || mat.cols == 0) return true;
+    const int chunk_cols = max<size_t>(1, (1 << 20) / column_bytes);
+    vector<char> buf(min(chunk_cols, mat.cols) * column_bytes);
+    for (int n = 0; n < mat.channels(); ++n) {
+        for (int c = 0; c < mat.cols; c += chunk_cols) {
+            const int ncols = min(chunk_cols, mat.cols - c);
+            transposeColumns<T>(mat, c, ncols, n, &(buf[0]));
+            if (!sink.write(&(buf[0]), ncols * column_bytes)) return false;
+        }
+    }
+    return true;
+}
+
+/*! @brief serialize a matrix, cell array, struct array or string
+ *
+ * Writes the miMATRIX tag followed by the array flags, dimensions and name
+ * subelements and the data. Cell arrays and struct arrays are written as
+ * 1xN, strings as 1xN char arrays in UTF-8.
+ *
+ * @param sink the destination
+ * @param variable the variable, which must have passed matrixBytes()
+ * @param name the stored name (empty for cell elements and struct fields)
+ * @return true if the variable was written
+ */
+static bool writeMatrix(MatlabIOSink& sink, const MatlabIOContainer& variable, const string& name) {
+    uint64_t nbytes;
+    if (!matrixBytes(variable, name.length(), nbytes)) return false;
+    if (!writeTag(sink, MAT_MATRIX, nbytes)) return false;
+
+    Mat mat;
+    uint32_t class_type = 0;
+    uint32_t stor_type = 0;
+    vector<int32_t> dims(2, 1);
+    if (numericMatrix(variable, mat)) {
+        matlabType(mat.depth(), class_type, stor_type);
+        dims[0] = mat.rows;
+        dims[1] = mat.cols;
+        if (mat.channels() > 1) dims.push_back(mat.channels());
+    } else if (variable.typeEquals<string>()) {
+        class_type = MAT_CHAR_CLASS;
+        dims[1] = variable.data<string>().length();
+    } else if (variable.typeEquals<vector<MatlabIOContainer> >()) {
+        class_type = MAT_CELL_CLASS;
+        dims[1] = variable.data<vector<MatlabIOContainer> >().size();
+    } else {
+        class_type = MAT_STRUCT_CLASS;
+        dims[1] = variable.data<vector<vector<MatlabIOContainer> > >().size();
+    }
+
+    // array flags, dimensions and name
+    const uint32_t flags[2] = { class_type, 0 };
+    if (!writeElement(sink, MAT_UINT32, flags, sizeof(flags))) return false;
+    if (!writeElement(sink, MAT_INT32, &(dims[0]), dims.size() * sizeof(int32_t))) return false;
+    if (!writeElement(sink, MAT_INT8, name.c_str(), name.length())) return false;
+
+    switch (class_type) {
+        case MAT_CHAR_CLASS: {
+            const string& str = variable.data<string>();
+            return writeElement(sink, MAT_UTF8, str.c_str(), str.length());
+        }
+        case MAT_CELL_CLASS: {
+            const vector<MatlabIOContainer>& cell = variable.data<vector<MatlabIOContainer> >();
+            for (unsigned int n = 0; n < cell.size(); ++n) {
+                if (!writeMatrix(sink, cell[n], string())) return false;
+            }
+            return true;
+        }
+        case MAT_STRUCT_CLASS: {
+            const vector<vector<MatlabIOContainer> >& array = variable.data<vector<vector<MatlabIOContainer> > >();
+            const size_t nfields = array.empty() ? 0 : array[0].size();
+            uint32_t length = 1;
+            for (unsigned int n = 0; n < nfields; ++n) length = max<uint32_t>(length, array[0][n].name().length() + 1);
+            // the field name length is a small data element
+            const uint32_t length_element[2] = { (4 << 16) | MAT_INT32, length };
+            if (!sink.write((const char *)length_element, sizeof(length_element))) return false;
+            vector<char> names(nfields * length, '\0');
+            for (unsigned int n = 0; n < nfields; ++n) array[0][n].name().copy(&(names[n * length]), length - 1);
+            if (!writeElement(sink, MAT_INT8, names.empty() ? NULL : &(names[0]), names.size())) return false;
+            for (unsigned int m = 0; m < array.size(); ++m) {
+                for (unsigned int n = 0; n < nfields; ++n) {
+                    if (!writeMatrix(sink, array[m][n], string())) return false;
+                }
+            }
+            return true;
+        }
+        default: break;
+    }
+
+    // the real part
+    const uint64_t real_bytes = mat.total() * mat.elemSize();
+    if (!writeTag(sink, stor_type, real_bytes)) return false;
+    bool ok = false;
+    switch (mat.depth()) {
+        case CV_8U:  ok = writePlanes<uint8_t>(sink, mat); break;
+        case CV_8S:  ok = writePlanes<int8_t>(sink, mat); break;
+        case CV_16U: ok = writePlanes<uint16_t>(sink, mat); break;
+        case CV_16S: ok = writePlanes<int16_t>(sink, mat); break;
+        case CV_32S: ok = writePlanes<int32_t>(sink, mat); break;
+        case CV_32F: ok = writePlanes<float>(sink, mat); break;
+        case CV_64F: ok = writePlanes<double>(sink, mat); break;
+        default: break;
+    }
+    return ok && writePadding(sink, real_bytes);
+}
+
+/*! @brief Write variables to the file
+ *
+ * The file must have been opened in the "w" mode, the header is written
+ * before the first variables. Numeric matrices of any depth but CV_16F
+ * (multi-channel matrices become MxNxC arrays), primitive scalars, strings,
+ * cell arrays (vector<MatlabIOContainer>) and struct arrays
+ * (vector<vector<MatlabIOContainer> >, whose elements all have the same fields)
+ * can be written, anything else is skipped.
+ * Uncompressed variables are streamed straight to the file. Compressed ones
+ * are deflated concurrently on a pool of threads, each into its own block,
+ * and written in order as soon as they are done. At most num_threads blocks
+ * are held in memory at once, the whole file never is.
+ *
+ * @param variables the variables to write, with their names
+ * @param compress whether to deflate each variable (at the fastest level)
+ * @param num_threads the number of threads deflating the variables
+ * (0 for the number of cores)
+ * @return true if all the variables were written
+ */
+bool MatlabIO::write(const vector<MatlabIOContainer>& variables, bool compress, int num_threads) {
+
+    if (!fid_.is_open()) return false;
+    if (fid_.tellp() == 0) setHeader();
+    MatlabIOStreamSink file(fid_);
+    bool ok = true;
+
+    // stream the uncompressed variables
+    if (!compress) {
+        for (unsigned int n = 0; n < variables.size(); ++n) {
+            uint64_t nbytes;
+            if (!matrixBytes(variables[n], variables[n].name().length(), nbytes)) {
+                ok = false;
+                continue;
+            }
+            if (!writeMatrix(file, variables[n], variables[n].name())) return false;
+        }
+        return ok && !fid_.fail();
+    }
+
+    // deflate the variables on a pool of threads, which stay
+    // at most num_threads variables ahead of the writer
+    const size_t count = variables.size();
+    if (num_threads <= 0) num_threads = max(1u, thread::hardware_concurrency());
+    vector<vector<char> > blocks(count);
+    vector<char> done(count, false);
+    vector<char> deflated(count, false);
+    size_t written = 0;
+    mutex block_mutex;
+    condition_variable cond;
+    atomic<size_t> next(0);
+    auto deflater = [&]() {
+        for (size_t n = next++; n < count; n = next++) {
+            {
+                unique_lock<mutex> guard(block_mutex);
+                cond.wait(guard, [&]() { return n < written + num_threads; });
+            }
+            MatlabIODeflateSink sink(blocks[n], Z_BEST_SPEED);
+            const bool res = writeMatrix(sink, variables[n], variables[n].name()) && sink.finish();
+            {
+                unique_lock<mutex> guard(block_mutex);
+                done[n] = true;
+                deflated[n] = res;
+            }
+            cond.notify_all();
+        }
+    };
+    vector<thread> threads;
+    for (size_t t = 0; t < min<size_t>(num_threads, count); ++t) threads.push_back(thread(deflater));
+
+    // write the blocks in order
+    for (size_t n = 0; n < count; ++n) {
+        {
+            unique_lock<mutex> guard(block_mutex);
+            cond.wait(guard, [&]() { return done[n] != 0; });
+        }
+        if (deflated[n] && blocks[n].size() <= UINT32_MAX) {
+            ok = writeTag(file, MAT_COMPRESSED, blocks[n].size()) && file.write(&(blocks[n][0]), blocks[n].size()) && ok;
+        } else {
+            ok = false;
+        }
+        vector<char>().swap(blocks[n]);
+        {
+            unique_lock<mutex> guard(block_mutex);
+            written++;
+        }
+        cond.notify_all();
+    }
+    for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+    return ok && !fid_.fail();
+}
+
 /*! @brief Print a formatted list of the contents of a file
  *
  * Similar to the 'whos' function in matlab, this function prints to stdout
  * a list of variables and their C++ datatypes stored in the associated .Mat file
  * @param variables the variables read from the .Mat file using the read() function
  */
-void MatlabIO::whos(vector<MatlabIOContainer> variables) const {
+void MatlabIO::whos(const vector<MatlabIOContainer>& variables) const {
 
 	// get the longest filename
 	unsigned int flmax = 0;
@@ -40,6 +40,7 @@
 #define MATLABIO_HPP_
 #include <string>
 #include <vector>
+#include <memory>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
@@ -55,6 +56,28 @@ enum {
     VERSION_73     = 73
 };
 
+/*! @struct MatlabIOVariable
+ *  @brief Directory entry of a top-level variable
+ *
+ *  Describes a variable without decoding its data, see MatlabIO::index()
+ */
+struct MatlabIOVariable {
+    std::string name;
+    // MAT_MATRIX or MAT_COMPRESSED
+    uint32_t data_type;
+    // MAT_*_CLASS of the matrix
+    uint32_t class_type;
+    std::vector<uint32_t> dims;
+    // position of the variable tag in the file and the size of the data after it
+    size_t offset;
+    uint32_t nbytes;
+    // position of the real part tag in the data (0 if unknown)
+    uint32_t real_offset;
+};
+
+// memory mapping of a file, unmapped with its last owner
+struct MatlabIOMapping;
+
 /*! @class MatlabIO
  *  @brief Matlab Mat file parser for C++ OpenCV
  *
@@ -78,24 +101,36 @@ private:
     int bytes_read_;
     std::string filename_;
     EFStream fid_;
+    // copy on write mapping of the file (mode "m"), shared with the views over it
+    std::shared_ptr<MatlabIOMapping> mapping_;
+    const char *map_;
+    size_t map_size_;
+    size_t map_pos_;
+    // variables found by index()
+    std::vector<MatlabIOVariable> directory_;
     // internal methods
     void getHeader(void);
     void setHeader(void);
     bool hasVariable(void) { return fid_.peek() != EOF; }
-	template<class T> MatlabIOContainer constructMatrix(std::vector<char>& name, std::vector<uint32_t>& dims, std::vector<char>& real, std::vector<char>& imag, uint32_t stor_type);
-	MatlabIOContainer constructString(std::vector<char>& name, std::vector<uint32_t>& dims, std::vector<char>& real);
-	MatlabIOContainer constructSparse(std::vector<char>& name, std::vector<uint32_t>& dims, std::vector<char>& real, std::vector<char>& imag);
-	MatlabIOContainer constructCell(std::vector<char>& name, std::vector<uint32_t>& dims, std::vector<char>& real);
-	MatlabIOContainer constructStruct(std::vector<char>& name, std::vector<uint32_t>& dims, std::vector<char>& real);
+	template<class T> MatlabIOContainer constructMatrix(std::vector<char>& name, std::vector<uint32_t>& dims, const char *real, uint32_t real_bytes, const char *imag, uint32_t imag_bytes, uint32_t stor_type);
+	MatlabIOContainer constructString(std::vector<char>& name, std::vector<uint32_t>& dims, const char *real, uint32_t real_bytes);
+	MatlabIOContainer constructSparse(std::vector<char>& name, std::vector<uint32_t>& dims, const char *real, const char *imag);
+	MatlabIOContainer constructCell(std::vector<char>& name, std::vector<uint32_t>& dims, const char *real);
+	MatlabIOContainer constructStruct(std::vector<char>& name, std::vector<uint32_t>& dims, const char *real);
 	const char *      readVariableTag(uint32_t &data_type, uint32_t &dbytes, uint32_t &wbytes, const char *data);
-	MatlabIOContainer collateMatrixFields(uint32_t data_type, uint32_t nbytes, std::vector<char> data);
-	std::vector<char> uncompressVariable(uint32_t& data_type, uint32_t& dbytes, uint32_t& wbytes, const std::vector<char> &data);
-    MatlabIOContainer readVariable(uint32_t data_type, uint32_t nbytes, const std::vector<char> &data);
-    MatlabIOContainer readBlock(void);
-    MatlabIOContainer uncompressFromBin(std::vector<char> data, uint32_t nbytes);
+	MatlabIOContainer collateMatrixFields(uint32_t data_type, uint32_t nbytes, const char *data);
+	bool              inflateMatrix(const char *data, uint32_t nbytes, MatlabIOContainer& variable);
+	bool              uncompressVariable(uint32_t& data_type, uint32_t& dbytes, uint32_t& wbytes, const char *data, uint32_t nbytes, std::vector<char>& udata);
+    MatlabIOContainer readVariable(uint32_t data_type, uint32_t nbytes, const char *data);
+    const char *      readBlock(uint32_t& data_type, uint32_t& dbytes, std::vector<char>& data);
+    const char *      readMappedBlock(uint32_t& data_type, uint32_t& dbytes);
+    bool readMatrixHeader(const char *data, uint32_t nbytes, MatlabIOVariable& variable);
+    bool readBytes(size_t offset, char *data, size_t nbytes, int width = 1);
+    template<class T> bool readSlice(const MatlabIOVariable& variable, size_t real, size_t imag, uint32_t stor_type, cv::Rect roi, cv::Mat& mat);
+    bool isMapped(const char *data) const { return map_ != NULL && data >= map_ && data < map_ + map_size_; }
 public:
     // constructors
-    MatlabIO() {}
+    MatlabIO() : map_(NULL), map_size_(0), map_pos_(0) {}
     // destructor
     ~MatlabIO() { close(); }
     // get and set methods
@@ -103,12 +138,17 @@ public:
     // read and write routines
     bool open(std::string filename, std::string mode);
     bool close(void);
-    std::vector<MatlabIOContainer> read(void);
-    void whos(std::vector<MatlabIOContainer> variables) const;
+    std::vector<MatlabIOContainer> read(int num_threads = 0);
+    std::vector<MatlabIOVariable> index(void);
+    MatlabIOContainer readVariable(std::string name);
+    MatlabIOContainer readVariable(std::string name, cv::Rect roi);
+    MatlabIOContainer readColumns(std::string name, int col0, int ncols);
+    bool write(const std::vector<MatlabIOContainer>& variables, bool compress = true, int num_threads = 0);
+    void whos(const std::vector<MatlabIOContainer>& variables) const;
 
     // templated functions (must be declared and defined in the header file)
     template<class T>
-    T find(std::vector<MatlabIOContainer>& variables, std::string name) const {
+    T find(const std::vector<MatlabIOContainer>& variables, std::string name) const {
     	for (unsigned int n = 0; n < variables.size(); ++n) {
     		if (variables[n].name().compare(name) == 0) {
     			if (isPrimitiveType<T>()) {
@@ -121,7 +161,7 @@ public:
     	throw new std::exception();
     }
 
-    MatlabIOContainer find(std::vector<MatlabIOContainer>& variables, std::string name) const {
+    const MatlabIOContainer& find(const std::vector<MatlabIOContainer>& variables, std::string name) const {
     	for (unsigned int n = 0; n < variables.size(); ++n) {
     		if (variables[n].name().compare(name) == 0) return variables[n];
     	}
@@ -129,7 +169,7 @@ public:
     }
 
     template<class T>
-    bool typeEquals(std::vector<MatlabIOContainer>& variables, std::string name) const {
+    bool typeEquals(const std::vector<MatlabIOContainer>& variables, std::string name) const {
     	for (unsigned int n = 0; n < variables.size(); ++n) {
     		if (variables[n].name().compare(name) == 0) return variables[n].typeEquals<T>();
     	}
@@ -38,23 +38,46 @@
 #ifndef MATLABIOCONTAINER_HPP_
 #define MATLABIOCONTAINER_HPP_
 #include <string>
+#include <vector>
+#include <utility>
 #include <typeinfo>
-#include <boost/any.hpp>
+#include <boost/variant.hpp>
 #include "typetraits.hpp"
 typedef std::vector<MatlabIOContainer> vectorMatlabIOContainer;
 typedef std::vector<std::vector<MatlabIOContainer> > vector2DMatlabIOContainer;
 
+/*! @brief The types a MatlabIOContainer can hold
+ *
+ *  Scalars of all the primitive types named in typetraits.hpp, matrices,
+ *  strings, cell arrays (vector<MatlabIOContainer>) and struct arrays
+ *  (vector<vector<MatlabIOContainer> >, one vector of named fields per
+ *  element). boost::blank means no stored value.
+ */
+typedef boost::variant<boost::blank, bool, char, uint8_t, int8_t, uint16_t, int16_t, uint32_t, int32_t,
+                       uint64_t, int64_t, float, double,
+                       cv::Mat, std::string, std::vector<cv::Mat>,
+                       std::vector<MatlabIOContainer>, std::vector<std::vector<MatlabIOContainer> > > MatlabIOVariant;
+
 /*! @class MatlabIOContainer
  *  @brief A container class for storing type agnostic variables
  *
- *  MatlabIOContainer stores variables of any type using the boost::any type.
- *  This allows multiple MatlabIOContainers to be stored in a single vector
- *  when reading multiple variables from a file or constructing a Matlab struct.
+ *  MatlabIOContainer stores variables of any of the MatlabIOVariant types.
+ *  The value is held in place rather than in a heap allocated holder, so
+ *  containers are cheap to create, and they are moved rather than copied
+ *  when a variable is handed over. This allows multiple MatlabIOContainers
+ *  to be stored in a single vector when reading multiple variables from a
+ *  file or constructing a Matlab struct.
  */
 class MatlabIOContainer {
 private: 
     std::string name_;
-    boost::any data_;
+    MatlabIOVariant data_;
+
+    // the type name of the stored value
+    struct TypeNameVisitor : public boost::static_visitor<std::string> {
+        std::string operator()(const boost::blank&) const { return TypeName<void>::toString(); }
+        template<class T> std::string operator()(const T&) const { return TypeName<T>::toString(); }
+    };
 
 public:
     // constructors
@@ -62,54 +85,40 @@ public:
     /*! @brief Constructor to initalize the container with data and an associated name
      *
      * @param name the string name of the variable
-     * @param data the associated data, of any type
+     * @param data the associated data, moved into the container
      */
-    MatlabIOContainer(const std::string name, const boost::any data) : name_(name), data_(data) {}
-    // destructor
-    ~MatlabIOContainer() {}
+    MatlabIOContainer(std::string name, MatlabIOVariant data) : name_(std::move(name)), data_(std::move(data)) {}
     // set methods
-    void setName(const std::string name) { name_ = name; }
-    void setData(const boost::any data) { data_ = data; }
+    void setName(std::string name) { name_ = std::move(name); }
+    void setData(MatlabIOVariant data) { data_ = std::move(data); }
     // get methods
     /*! @brief Check if the stored type is equal to the templated type
      *
-     * This method uses typeid(T) internally, so child classes may return true
-     * if compared with their parent.
-     * @return true if the types are equal (premised on the above conditions), false otherwise
+     * @return true if the stored value is of type T, false otherwise
      */
     template<class T> bool typeEquals(void) const { return data_.type() == typeid(T); }
     /*! @brief The type of the variable
      *
-     * Returns a string containing the type of the variable. This may or may not be
-     * human readable (Microsoft compilers will produce human readable outputs, GCC
-     * compilers will not) but are guaranteed to be unique for unique types
+     * Returns a string containing the type of the variable, human readable
+     * for all the types a container can hold.
      * @return the variable type as a string
      */
-    std::string type(void) const {
-    	const std::type_info& tp = data_.type();
-		if (tp == typeid(uint8_t)) return TypeName<uint8_t>::toString();
-		if (tp == typeid(int8_t))  return TypeName<int8_t>::toString();
-		if (tp == typeid(uint16_t)) return TypeName<uint16_t>::toString();
-		if (tp == typeid(int16_t)) return TypeName<int16_t>::toString();
-		if (tp == typeid(int32_t)) return TypeName<int32_t>::toString();
-		if (tp == typeid(float)) return TypeName<float>::toString();
-		if (tp == typeid(double)) return TypeName<double>::toString();
-		if (tp == typeid(cv::Mat)) return TypeName<cv::Mat>::toString();
-		if (tp == typeid(MatlabIOContainer)) return TypeName<MatlabIOContainer>::toString();
-		if (tp == typeid(std::vector<MatlabIOContainer>)) return TypeName<std::vector<MatlabIOContainer> >::toString();
-		if (tp == typeid(std::vector<std::vector<MatlabIOContainer> >)) return TypeName<std::vector<std::vector<MatlabIOContainer> > >::toString();
-		if (tp == typeid(std::vector<cv::Mat>)) return TypeName<std::vector<cv::Mat> >::toString();
-		if (tp == typeid(void)) return TypeName<void>::toString();
-		return std::string(tp.name());
-	}
-    std::string name(void) const { return name_; }
+    std::string type(void) const { return boost::apply_visitor(TypeNameVisitor(), data_); }
+    const std::string& name(void) const { return name_; }
     /*! @brief The stored data
      *
-     * Returns the stored data, cast to the templated type
-     * @throw boost::bad_any_cast if the requested type is not the stored data type
+     * Returns a reference to the stored data, valid as long as the container
+     * is neither modified nor destroyed
+     * @throw boost::bad_get if the requested type is not the stored data type
+     * @return the data
+     */
+    template<class T> const T& data(void) const { return boost::relaxed_get<T>(data_); }
+    /*! @brief The stored data, for modifying or moving out of the container
+     *
+     * @throw boost::bad_get if the requested type is not the stored data type
      * @return the data
      */
-    template<class T> T data(void) const { return boost::any_cast<T>(data_); }
+    template<class T> T& data(void) { return boost::relaxed_get<T>(data_); }
 
     // --------------------------------------------------------------------------------------
     // OPENCV FILENODE METHODS
@@ -81,6 +81,19 @@ enum {
 	MAT_UINT64_CLASS   = 15
 };
 
+// storage type of a primitive type in a Mat file
+template <typename T> struct MatlabStorageType { enum { value = 0 }; };
+template <> struct MatlabStorageType<int8_t>   { enum { value = MAT_INT8 }; };
+template <> struct MatlabStorageType<uint8_t>  { enum { value = MAT_UINT8 }; };
+template <> struct MatlabStorageType<int16_t>  { enum { value = MAT_INT16 }; };
+template <> struct MatlabStorageType<uint16_t> { enum { value = MAT_UINT16 }; };
+template <> struct MatlabStorageType<int32_t>  { enum { value = MAT_INT32 }; };
+template <> struct MatlabStorageType<uint32_t> { enum { value = MAT_UINT32 }; };
+template <> struct MatlabStorageType<int64_t>  { enum { value = MAT_INT64 }; };
+template <> struct MatlabStorageType<uint64_t> { enum { value = MAT_UINT64 }; };
+template <> struct MatlabStorageType<float>    { enum { value = MAT_FLOAT }; };
+template <> struct MatlabStorageType<double>   { enum { value = MAT_DOUBLE }; };
+
 // default implementation
 template <typename T>
 struct TypeName {
@@ -143,6 +156,11 @@ struct TypeName<char> {
 	static const std::string toString() { return "string"; }
 };
 
+template <>
+struct TypeName<std::string> {
+	static const std::string toString() { return "string"; }
+};
+
 template <>
 struct TypeName<bool> {
 	static const std::string toString() { return "logical"; }
@@ -1,66 +1,379 @@
 #include "logging.hpp"
+#include "metricsfile.hpp"
 
+#include <chrono>
+#include <cstring>
 #include <fstream>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
-ofstream Logger::logFile;
-ofstream Logger::dataFile;
+atomic<int> Logger::level( static_cast<int>(LogLevel::VERBOSE_LEVEL) );
+
+namespace {
+
+// Number of queued messages (a power of 2)
+const size_t LOG_QUEUE_CAPACITY = 8192;
+// Size of the batches written at once
+const size_t LOG_BATCH_SIZE = 1 << 16;
+// Larger slot buffers (metrics chunks) are released rather than recycled
+const size_t LOG_SLOT_CAPACITY = 1 << 12;
+// Number of samples of a metrics chunk
+const size_t METRICS_CHUNK_SIZE = 4096;
+
+struct LogSlot {
+	// Equal to n when the slot is free for message n,
+	// and to n + 1 when message n is ready in it
+	atomic<uint64_t> sequence;
+	int targets;
+	string text;
+};
+
+/* Background writer. Producers claim the next slot with a compare and swap
+   on the head and publish it through its sequence, the writer takes the
+   slots in order, so the messages keep the order in which they were claimed. */
+class LogWriter {
+	private:
+		vector<LogSlot> ring;
+		atomic<uint64_t> head;
+		atomic<uint64_t> written;
+		atomic<bool> stopped;
+		thread worker;
+
+		// Write the batches, the files are only touched under the mutex
+		void write( string &console, string &log, string &metrics ) {
+			if ( !console.empty() ) {
+				cout.write( console.data(), console.size() );
+				cout.flush();
+				console.clear();
+			}
+			if ( !log.empty() || !metrics.empty() ) {
+				lock_guard<mutex> guard( this->fileMutex );
+				if ( !log.empty() && this->logFile.is_open() ) {
+					this->logFile.write( log.data(), log.size() );
+					this->logFile.flush();
+				}
+				// Metrics are left in the buffer of the stream until it is full
+				if ( !metrics.empty() && this->metricsFile.is_open() ) {
+					this->metricsFile.write( metrics.data(), metrics.size() );
+				}
+				log.clear();
+				metrics.clear();
+			}
+		}
+
+		void run( ) {
+			string console, log, metrics;
+			uint64_t tail = 0;
+			int idle = 0;
+
+			while ( true ) {
+				// Take the ready messages into the batches
+				size_t batch = 0;
+				while ( batch < LOG_BATCH_SIZE ) {
+					LogSlot &slot = this->ring[tail & (this->ring.size() - 1)];
+					if ( slot.sequence.load(memory_order_acquire) != tail + 1 ) {
+						break;
+					}
+					if ( slot.targets & Logger::TO_CONSOLE ) {
+						console += slot.text;
+					}
+					if ( slot.targets & Logger::TO_LOG ) {
+						log += slot.text;
+					}
+					if ( slot.targets & Logger::TO_METRICS ) {
+						metrics += slot.text;
+					}
+					batch += slot.text.size() + 1;
+					if ( slot.text.capacity() > LOG_SLOT_CAPACITY ) {
+						string().swap( slot.text );
+					} else {
+						slot.text.clear();
+					}
+					slot.sequence.store(tail + this->ring.size(), memory_order_release);
+					tail++;
+				}
+				if ( batch > 0 ) {
+					this->write( console, log, metrics );
+					this->written.store(tail, memory_order_release);
+					idle = 0;
+				} else if ( this->stopped && tail == this->head.load() ) {
+					return;
+				} else if ( ++idle < 64 ) {
+					this_thread::yield();
+				} else {
+					this_thread::sleep_for( chrono::milliseconds(1) );
+				}
+			}
+		}
+
+	public:
+		mutex fileMutex;
+		ofstream logFile;
+		ofstream metricsFile;
+		atomic<int> overflow;
+		atomic<uint64_t> dropped;
+		// Names of the metrics by id, under the mutex, written again into every metrics file
+		vector<string> metricNames;
+
+		LogWriter( )
+			: ring(LOG_QUEUE_CAPACITY), head(0), written(0), stopped(false),
+			  overflow(static_cast<int>(LogOverflow::BLOCK)), dropped(0) {
+			for ( size_t s = 0; s < this->ring.size(); s++ ) {
+				this->ring[s].sequence = s;
+				this->ring[s].targets = 0;
+			}
+			this->worker = thread(&LogWriter::run, this);
+		}
+		~LogWriter( ) {
+			this->stopped = true;
+			if ( this->worker.joinable() ) {
+				this->worker.join();
+			}
+		}
+
+		bool push( string &text, int targets, bool mayDrop ) {
+			uint64_t n = this->head.load(memory_order_relaxed);
+			LogSlot *slot;
+
+			while ( true ) {
+				slot = &this->ring[n & (this->ring.size() - 1)];
+				const uint64_t sequence = slot->sequence.load(memory_order_acquire);
+				if ( sequence == n ) {
+					if ( this->head.compare_exchange_weak(n, n + 1, memory_order_relaxed) ) {
+						break;
+					}
+				} else if ( sequence < n ) {
+					// Full, the writer has not freed the slot yet
+					if ( mayDrop && this->overflow == static_cast<int>(LogOverflow::DROP) ) {
+						this->dropped++;
+						return false;
+					}
+					this_thread::yield();
+					n = this->head.load(memory_order_relaxed);
+				} else {
+					n = this->head.load(memory_order_relaxed);
+				}
+			}
+			// The caller gets the previous buffer of the slot, so nothing is allocated
+			swap( slot->text, text );
+			slot->targets = targets;
+			slot->sequence.store(n + 1, memory_order_release);
+			return true;
+		}
+
+		void flush( ) {
+			const uint64_t target = this->head.load();
+			while ( this->written.load(memory_order_acquire) < target ) {
+				this_thread::yield();
+			}
+		}
+};
+
+LogWriter& writer( ) {
+	static LogWriter w;
+	return w;
+}
+
+// Samples of a thread, stored by column as in a samples chunk
+struct MetricsBuffer {
+	vector<uint64_t> steps;
+	vector<uint32_t> ids;
+	vector<double> values;
+	string chunk;
+
+	MetricsBuffer( ) {
+		this->steps.reserve( METRICS_CHUNK_SIZE );
+		this->ids.reserve( METRICS_CHUNK_SIZE );
+		this->values.reserve( METRICS_CHUNK_SIZE );
+	}
+	~MetricsBuffer( ) {
+		this->flush();
+	}
+	// Queue the samples as a chunk
+	void flush( ) {
+		if ( this->steps.empty() ) {
+			return;
+		}
+		MetricsChunkHeader header = { METRICS_CHUNK_SAMPLES, static_cast<uint32_t>(this->steps.size()) };
+		const size_t idsSize = metricsFileAlign( this->ids.size() * sizeof(uint32_t) );
+		this->ids.resize( idsSize / sizeof(uint32_t), 0 );
+
+		this->chunk.clear();
+		this->chunk.append( reinterpret_cast<const char*>(&header), sizeof(header) );
+		this->chunk.append( reinterpret_cast<const char*>(this->steps.data()), this->steps.size() * sizeof(uint64_t) );
+		this->chunk.append( reinterpret_cast<const char*>(this->ids.data()), idsSize );
+		this->chunk.append( reinterpret_cast<const char*>(this->values.data()), this->values.size() * sizeof(double) );
+		writer().push( this->chunk, Logger::TO_METRICS, false );
+		this->steps.clear();
+		this->ids.clear();
+		this->values.clear();
+	}
+};
+
+// Append the names chunk of a metric
+void appendMetricName( string &chunk, uint32_t id, const string &name ) {
+	MetricsChunkHeader header = { METRICS_CHUNK_NAME, 0 };
+	const uint32_t entry[2] = { id, static_cast<uint32_t>(name.size()) };
+	chunk.append( reinterpret_cast<const char*>(&header), sizeof(header) );
+	chunk.append( reinterpret_cast<const char*>(entry), sizeof(entry) );
+	chunk.append( name );
+	chunk.resize( chunk.size() + metricsFileAlign( name.size() ) - name.size(), '\0' );
+}
+
+MetricsBuffer& metricsBuffer( ) {
+	static thread_local MetricsBuffer buffer;
+	return buffer;
+}
+
+}
+
+bool Logger::push( string &text, int targets, bool mayDrop ) {
+	return writer().push( text, targets, mayDrop );
+}
+
+string& Logger::buffer( ) {
+	static thread_local string text;
+	return text;
+}
 
 void Logger::open() {
 	stringstream fileName;
 	fileName << "experiment" << ".log";
-	logFile.open( fileName.str().c_str(), std::ios::out );
+	flush();
+	lock_guard<mutex> guard( writer().fileMutex );
+	writer().logFile.open( fileName.str().c_str(), std::ios::out );
 }
 
-void Logger::openData() {
-	stringstream fileName;
-	fileName << "data" << ".log";
-	dataFile.open( fileName.str().c_str(), std::ios::out );
+void Logger::openMetrics( string fileName ) {
+	MetricsFileHeader header;
+	memcpy( header.magic, METRICS_FILE_MAGIC, sizeof(METRICS_FILE_MAGIC) );
+	header.version = METRICS_FILE_VERSION;
+	flush();
+	lock_guard<mutex> guard( writer().fileMutex );
+	writer().metricsFile.open( fileName.c_str(), std::ios::out | std::ios::binary );
+	writer().metricsFile.write( reinterpret_cast<const char*>(&header), sizeof(header) );
+	// The metrics defined so far (their names queued for a previous file, or
+	// dropped while no file was open) are named again in the new file
+	string names;
+	for ( size_t id = 0; id < writer().metricNames.size(); id++ ) {
+		appendMetricName( names, static_cast<uint32_t>(id), writer().metricNames[id] );
+	}
+	writer().metricsFile.write( names.data(), names.size() );
 }
 
 void Logger::close() {
-	if (logFile.is_open()) {
-		logFile.close();
+	flushMetrics();
+	flush();
+	lock_guard<mutex> guard( writer().fileMutex );
+	if (writer().logFile.is_open()) {
+		writer().logFile.close();
 	}
-	if (dataFile.is_open()) {
-		dataFile.close();
+	if (writer().metricsFile.is_open()) {
+		writer().metricsFile.close();
 	}
 }
 
+void Logger::flush() {
+	writer().flush();
+}
+
 void Logger::info( string msg, bool newLine, bool infoPrefix ) {
+	if ( !isEnabled(LogLevel::INFO_LEVEL) ) {
+		return;
+	}
+	string &text = buffer();
+	text.clear();
 	if (infoPrefix) {
-		cout << "[INFO] ";
-		logFile << "[INFO] ";
+		text += "[INFO] ";
 	}
-	cout << msg;
-	logFile << msg;
+	text += msg;
 	if (newLine) {
-		cout << endl;
-		logFile << endl;
+		text += '\n';
 	}
-	cout << std::flush;
-	logFile << std::flush;
+	push( text, TO_CONSOLE | TO_LOG, true );
 }
 
 void Logger::warning( string msg ) {
-	cout << "[WARN] " << msg << endl;
-	logFile << "[WARN] " << msg << endl << std::flush;
+	if ( !isEnabled(LogLevel::WARNING_LEVEL) ) {
+		return;
+	}
+	string &text = buffer();
+	text.clear();
+	text += "[WARN] ";
+	text += msg;
+	text += '\n';
+	push( text, TO_CONSOLE | TO_LOG, false );
 }
 
+// Errors are written before returning, in case the program stops right after
 void Logger::error( string msg ) {
-	cout << "[ERROR] " << msg << endl;
-	logFile << "[ERROR] " << msg << endl << std::flush;
+	if ( !isEnabled(LogLevel::ERROR_LEVEL) ) {
+		return;
+	}
+	string &text = buffer();
+	text.clear();
+	text += "[ERROR] ";
+	text += msg;
+	text += '\n';
+	push( text, TO_CONSOLE | TO_LOG, false );
+	flush();
 }
 
 void Logger::str( string msg, bool hide ) {
-	if (!hide) {
-		cout << msg;
+	if ( !isEnabled(LogLevel::INFO_LEVEL) ) {
+		return;
 	}
-	logFile << msg << std::flush;
+	string &text = buffer();
+	text.clear();
+	text += msg;
+	push( text, (hide)? TO_LOG : TO_CONSOLE | TO_LOG, true );
+}
+
+// The name is queued right away, so it precedes the samples in the file.
+// The ids stay valid across files, openMetrics() names them all again.
+uint32_t Logger::defineMetric( string name ) {
+	uint32_t id;
+	{
+		lock_guard<mutex> guard( writer().fileMutex );
+		id = static_cast<uint32_t>(writer().metricNames.size());
+		writer().metricNames.push_back( name );
+	}
+	string chunk;
+	appendMetricName( chunk, id, name );
+	push( chunk, TO_METRICS, false );
+	return id;
+}
+
+void Logger::metric( uint64_t timestep, uint32_t id, double value ) {
+	MetricsBuffer &samples = metricsBuffer();
+	samples.steps.push_back( timestep );
+	samples.ids.push_back( id );
+	samples.values.push_back( value );
+	if ( samples.steps.size() >= METRICS_CHUNK_SIZE ) {
+		samples.flush();
+	}
+}
+
+void Logger::flushMetrics( ) {
+	metricsBuffer().flush();
+}
+
+void Logger::setLevel( LogLevel minLevel ) {
+	level = static_cast<int>(minLevel);
+}
+
+LogLevel Logger::getLevel( ) {
+	return static_cast<LogLevel>(level.load());
+}
+
+void Logger::setOverflow( LogOverflow policy ) {
+	writer().overflow = static_cast<int>(policy);
 }
 
-void Logger::data( string msg ) {
-	dataFile << msg << std::flush;
+uint64_t Logger::getDropped( ) {
+	return writer().dropped;
 }
@@ -1,25 +1,138 @@
 #ifndef LOGGING_HPP_
 #define LOGGING_HPP_
 
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <type_traits>
 
 using namespace std;
 
+// Messages below the level of the logger are discarded before being formatted
+enum class LogLevel {
+	VERBOSE_LEVEL,
+	INFO_LEVEL,
+	WARNING_LEVEL,
+	ERROR_LEVEL,
+	SILENT_LEVEL
+};
+
+// When the queue of the writer is full, messages could be dropped (and counted)
+// or the logging thread could wait for a free slot. Warnings and errors always wait.
+enum class LogOverflow {
+	DROP,
+	BLOCK
+};
+
+/* Messages are formatted on the calling thread into a reused buffer and handed
+   over to a background thread through a lock-free multi-producer ring, so that
+   logging costs no lock and no system call. The writer thread appends the
+   queued messages into one batch per destination and writes each batch at once.
+   Metrics go through the same queue as whole binary chunks. */
 class Logger {
 	private:
-		static ofstream logFile;
-		static ofstream dataFile;
+		static atomic<int> level;
+
+		// Queue the text (swapped with the buffer of a free slot),
+		// returns false when it was dropped
+		static bool push( string &text, int targets, bool mayDrop );
+		// Buffer reused by the formatting of every thread
+		static string& buffer( );
+
+		// Append a value to a message (only char is appended as a character,
+		// the other integers, uchar included, are appended as numbers)
+		static void append( string &out, const string &value ) {
+			out += value;
+		}
+		static void append( string &out, const char *value ) {
+			out += value;
+		}
+		static void append( string &out, char value ) {
+			out += value;
+		}
+		template<typename T>
+		static void append( string &out, const T &value, typename enable_if<is_integral<T>::value>::type* = nullptr ) {
+			char buf[24];
+			int len = ( is_signed<T>::value )? snprintf( buf, sizeof(buf), "%lld", static_cast<long long>(value) )
+			                                 : snprintf( buf, sizeof(buf), "%llu", static_cast<unsigned long long>(value) );
+			out.append( buf, len );
+		}
+		template<typename T>
+		static void append( string &out, const T &value, typename enable_if<is_floating_point<T>::value>::type* = nullptr ) {
+			char buf[32];
+			out.append( buf, snprintf( buf, sizeof(buf), "%g", static_cast<double>(value) ) );
+		}
+		template<typename T>
+		static void append( string &out, const T &value, typename enable_if<!is_arithmetic<T>::value>::type* = nullptr ) {
+			ostringstream ss;
+			ss << value;
+			out += ss.str();
+		}
+		static void format( string& ) {
+
+		}
+		template<typename T, typename... Args>
+		static void format( string &out, const T &value, const Args&... args ) {
+			append( out, value );
+			format( out, args... );
+		}
 
 	public:
+		// Destinations of a message
+		static const int TO_CONSOLE = 0x01;
+		static const int TO_LOG = 0x02;
+		static const int TO_METRICS = 0x04;
+
 		static void open();
-		static void openData();
 		static void close();
+		// Wait until everything logged so far has been written
+		static void flush();
 		static void info( string msg, bool newLine = true, bool infoPrefix = true );
 		static void warning( string msg );
 		static void error( string msg );
 		static void str( string msg, bool hide = false );
-		static void data( string msg );
+
+		// Metrics are recorded as binary samples (see metricsfile.hpp), buffered per
+		// thread and queued by chunks when the buffer fills, the thread ends, or
+		// flushMetrics() is called by the thread (close() does it for the caller)
+		static void openMetrics( string fileName = "metrics.bin" );
+		// Get the id of a new metric, valid in every metrics file opened afterwards
+		static uint32_t defineMetric( string name );
+		static void metric( uint64_t timestep, uint32_t id, double value );
+		static void flushMetrics( );
+
+		// Format and log a message made of all the arguments, e.g.
+		// Logger::log( LogLevel::VERBOSE_LEVEL, "column ", i, " overlap ", overlap );
+		template<typename... Args>
+		static void log( LogLevel msgLevel, const Args&... args ) {
+			if ( !isEnabled(msgLevel) ) {
+				return;
+			}
+			string &text = buffer();
+			text.clear();
+			switch ( msgLevel ) {
+				case LogLevel::WARNING_LEVEL: text += "[WARN] "; break;
+				case LogLevel::ERROR_LEVEL: text += "[ERROR] "; break;
+				default: text += "[INFO] "; break;
+			}
+			format( text, args... );
+			text += '\n';
+			push( text, TO_CONSOLE | TO_LOG, msgLevel < LogLevel::WARNING_LEVEL );
+		}
+
+		// Level and overflow policy
+		static inline bool isEnabled( LogLevel msgLevel ) {
+			return static_cast<int>(msgLevel) >= level.load(memory_order_relaxed);
+		}
+		static void setLevel( LogLevel minLevel );
+		static LogLevel getLevel( );
+		static void setOverflow( LogOverflow policy );
+		// Number of messages dropped because the queue was full
+		static uint64_t getDropped( );
 };
 
 #endif /* LOGGING_HPP_ */
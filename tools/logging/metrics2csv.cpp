@@ -0,0 +1,17 @@
+#include <iostream>
+#include "metricsfile.hpp"
+
+using namespace std;
+
+// Convert a binary metrics file written by Logger::metric into CSV
+int main( int argc, char **argv ) {
+	if ( argc != 3 ) {
+		cout << "Usage: " << argv[0] << " <metrics file> <csv file>" << endl;
+		return 1;
+	}
+	if ( !convertMetricsFile( argv[1], argv[2] ) ) {
+		cout << "Failure: unable to convert " << argv[1] << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,70 @@
+#include "metricsfile.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <vector>
+
+bool convertMetricsFile( std::string fileName, std::string csvFileName ) {
+	std::ifstream in( fileName.c_str(), std::ios::in | std::ios::binary );
+	MetricsFileHeader header;
+	if ( !in.read( reinterpret_cast<char*>(&header), sizeof(header) ) || !isMetricsFileHeader( header ) ) {
+		return false;
+	}
+	std::ofstream out( csvFileName.c_str(), std::ios::out );
+	if ( !out.is_open() ) {
+		return false;
+	}
+
+	std::map<uint32_t, std::string> names;
+	std::vector<uint64_t> steps;
+	std::vector<uint32_t> ids;
+	std::vector<double> values;
+	std::string csv;
+	char line[64];
+
+	out << "timestep,metric,value\n";
+	MetricsChunkHeader chunk;
+	while ( in.read( reinterpret_cast<char*>(&chunk), sizeof(chunk) ) ) {
+		if ( chunk.type == METRICS_CHUNK_NAME ) {
+			uint32_t entry[2];
+			if ( !in.read( reinterpret_cast<char*>(entry), sizeof(entry) ) ) {
+				return false;
+			}
+			std::string name( metricsFileAlign( entry[1] ), '\0' );
+			if ( !in.read( &name[0], name.size() ) ) {
+				return false;
+			}
+			names[entry[0]] = name.substr( 0, entry[1] );
+		} else if ( chunk.type == METRICS_CHUNK_SAMPLES ) {
+			// Read the columns of the chunk
+			steps.resize( chunk.count );
+			ids.resize( metricsFileAlign( chunk.count * sizeof(uint32_t) ) / sizeof(uint32_t) );
+			values.resize( chunk.count );
+			if ( !in.read( reinterpret_cast<char*>(steps.data()), chunk.count * sizeof(uint64_t) ) ||
+			     !in.read( reinterpret_cast<char*>(ids.data()), ids.size() * sizeof(uint32_t) ) ||
+			     !in.read( reinterpret_cast<char*>(values.data()), chunk.count * sizeof(double) ) ) {
+				return false;
+			}
+			// Write the lines of the whole chunk at once
+			csv.clear();
+			for ( size_t n = 0; n < chunk.count; n++ ) {
+				std::map<uint32_t, std::string>::const_iterator name = names.find( ids[n] );
+				snprintf( line, sizeof(line), "%llu,", static_cast<unsigned long long>(steps[n]) );
+				csv += line;
+				if ( name != names.end() ) {
+					csv += name->second;
+				} else {
+					snprintf( line, sizeof(line), "%u", ids[n] );
+					csv += line;
+				}
+				snprintf( line, sizeof(line), ",%.17g\n", values[n] );
+				csv += line;
+			}
+			out.write( csv.data(), csv.size() );
+		} else {
+			return false;
+		}
+	}
+	return !out.fail();
+}
@@ -0,0 +1,51 @@
+#ifndef METRICSFILE_HPP_
+#define METRICSFILE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/* Binary metrics file layout (native byte order):
+   - MetricsFileHeader
+   - chunks, each starting with a MetricsChunkHeader:
+     - names chunk (one metric): uint32_t id, uint32_t length, the name
+     - samples chunk (count samples, stored by column):
+       timesteps (uint64_t[count]), metric ids (uint32_t[count]), values (double[count])
+   Every chunk and every column starts at a multiple of 8 bytes. The name of a
+   metric is stored before its first sample, possibly more than once. The chunks
+   of different threads are interleaved, so the samples are only ordered within
+   a chunk. */
+
+const char METRICS_FILE_MAGIC[4] = { 'H', 'T', 'M', 'M' };
+const uint32_t METRICS_FILE_VERSION = 1;
+const uint32_t METRICS_CHUNK_NAME = 1;
+const uint32_t METRICS_CHUNK_SAMPLES = 2;
+
+struct MetricsFileHeader {
+	char magic[4];
+	uint32_t version;
+};
+
+struct MetricsChunkHeader {
+	uint32_t type;
+	// Number of samples, unused in a names chunk
+	uint32_t count;
+};
+
+// Size of a section padded to the 8 byte boundary
+inline size_t metricsFileAlign( size_t size ) {
+	return (size + 7) & ~static_cast<size_t>(7);
+}
+
+// Check magic and version
+inline bool isMetricsFileHeader( const MetricsFileHeader &header ) {
+	return memcmp( header.magic, METRICS_FILE_MAGIC, sizeof(METRICS_FILE_MAGIC) ) == 0 &&
+	       header.version == METRICS_FILE_VERSION;
+}
+
+// Convert a metrics file into CSV lines "timestep,metric,value", the metrics
+// named by their names, returns false when the file is not a metrics file
+bool convertMetricsFile( std::string fileName, std::string csvFileName );
+
+#endif /* METRICSFILE_HPP_ */